@@ -0,0 +1,651 @@
+/*
+ * KCB-5 HTTP driver load generator / benchmark harness
+ * Starts the driver on a loopback port with all buses on the built-in
+ * emulators ("emu:" devices) and drives it
+ * with closed-loop (fixed concurrency) and open-loop (fixed arrival rate)
+ * load. Open-loop latency is measured from the intended send time, so a
+ * stalled server is charged for the requests it kept waiting (coordinated
+ * omission correction, as in wrk2).
+ * Results are printed to stdout as one JSON document.
+ *
+ * Usage: kcb5_bench [path/to/driver]   (default: ./driver)
+ *        kcb5_bench --check [path/to/driver]
+ * --check runs functional checks instead and exits non-zero if one fails:
+ * request framing, input validation, batch rollback and delays against client
+ * watchdogs, UDP sequence gates and the /stage table.
+ * Configuration via environment variables:
+ * - BENCH_PORT: loopback port for the driver under test (default: 18080)
+ * - BENCH_SECONDS: duration of each run (default: 2)
+ * - BENCH_CONNS: comma-separated connection counts (default: "1,4,16")
+ * - BENCH_RATE: open-loop arrival rate in req/s, 0 disables (default: 2000)
+ * - BENCH_ENDPOINTS: comma-separated subset of status,servo,bus,uart
+ * - BENCH_UART_PORT, BENCH_ICS_PORT: emulator specs (default: "emu:"), e.g.
+ *   "emu:kcb5.script" to script the far end
+ * - BENCH_I2C_DEV: I2C device (default: "emu:"); --check sets a missing one so
+ *   I2C writes fail
+ * EMU_* variables are passed through to the driver.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define MAX_CONNS 256
+#define RESP_BUF 16384
+
+static char* getenv_default(const char *k, const char *def) {
+    char *v = getenv(k);
+    return v ? v : (char*)def;
+}
+static int getenv_int(const char *k, int def) {
+    char *v = getenv(k);
+    return v ? atoi(v) : def;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Endpoints under test
+typedef struct {
+    const char *name, *method, *path, *body;
+} endpoint_t;
+
+static const endpoint_t endpoints[] = {
+    {"status", "GET",  "/status", ""},
+    {"servo",  "PUT",  "/servo",  "{\"id\":1,\"pos\":7500,\"param\":0}"},
+    {"bus",    "PUT",  "/bus",    "{\"bus\":\"i2c\",\"addr\":80,\"data\":[0,16,32,48]}"},
+    {"uart",   "POST", "/uart",   "{\"data\":[1,2,3,4,5,6,7,8]}"},
+};
+#define N_ENDPOINTS (sizeof(endpoints)/sizeof(endpoints[0]))
+
+// Latency histogram
+// Log-linear buckets: 32 linear sub-buckets per power of two of microseconds,
+// good to ~3% relative error from 1us up to ~70 minutes.
+#define HIST_SUB 32
+#define HIST_EXP 32
+typedef struct {
+    uint64_t count[HIST_EXP * HIST_SUB];
+    uint64_t total, max_us;
+} hist_t;
+
+static int hist_index(uint64_t us) {
+    if (us < HIST_SUB) return (int)us;
+    int e = 63 - __builtin_clzll(us) - 4;       // us >> e lands in [32, 64)
+    if (e >= HIST_EXP - 1) return HIST_EXP * HIST_SUB - 1;
+    return (e + 1) * HIST_SUB + (int)((us >> e) - HIST_SUB);
+}
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int e = idx / HIST_SUB - 1;
+    return ((uint64_t)(idx % HIST_SUB + HIST_SUB) << e) + ((1ull << e) >> 1);
+}
+static void hist_record(hist_t *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    h->count[hist_index(us)]++;
+    h->total++;
+    if (us > h->max_us) h->max_us = us;
+}
+static uint64_t hist_percentile(const hist_t *h, double p) {
+    if (!h->total) return 0;
+    uint64_t want = (uint64_t)(p / 100.0 * h->total + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_EXP * HIST_SUB; i++) {
+        seen += h->count[i];
+        if (seen >= want) return hist_value(i) < h->max_us ? hist_value(i) : h->max_us;
+    }
+    return h->max_us;
+}
+
+// Client connections
+enum { C_IDLE, C_CONNECTING, C_SENDING, C_READING };
+
+typedef struct {
+    int fd, state, reused;
+    uint64_t t_start;       // intended start (open loop) or actual start (closed loop)
+    size_t sent, rlen;
+    char rbuf[RESP_BUF];
+} client_t;
+
+typedef struct {
+    const endpoint_t *ep;
+    int conns, keepalive;
+    double rate;            // 0: closed loop
+    int seconds, port;
+} run_cfg_t;
+
+typedef struct {
+    uint64_t ok, errors, reconnects;
+    double elapsed;
+    hist_t hist;
+} run_res_t;
+
+static char req_buf[1024];
+static int req_len;
+
+static void build_request(const run_cfg_t *cfg) {
+    const endpoint_t *ep = cfg->ep;
+    req_len = snprintf(req_buf, sizeof(req_buf),
+        "%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: %s\r\n"
+        "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+        ep->method, ep->path, cfg->keepalive ? "keep-alive" : "close",
+        strlen(ep->body), ep->body);
+}
+
+static int client_connect(int ep, client_t *c, int port) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in a = {0};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    c->state = C_CONNECTING;
+    c->reused = 0;
+    if (connect(c->fd, (struct sockaddr*)&a, sizeof(a)) < 0 && errno != EINPROGRESS) {
+        close(c->fd); c->fd = -1; return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLIN, .data.ptr = c};
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+static void client_close(client_t *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->state = C_IDLE;
+}
+
+// Returns 1 once a full response is buffered, 0 if more is needed, -1 on a bad response.
+static int response_complete(client_t *c) {
+    c->rbuf[c->rlen] = 0;
+    char *hdr_end = strstr(c->rbuf, "\r\n\r\n");
+    if (!hdr_end) return c->rlen >= RESP_BUF - 1 ? -1 : 0;
+    if (strncmp(c->rbuf, "HTTP/1.", 7) != 0) return -1;
+    const char *cl = strcasestr(c->rbuf, "Content-Length:");
+    size_t body = cl && cl < hdr_end ? strtoul(cl + 15, NULL, 10) : 0;
+    size_t need = (hdr_end + 4 - c->rbuf) + body;
+    if (need >= RESP_BUF) return -1;
+    return c->rlen >= need ? 1 : 0;
+}
+
+static int response_status(const client_t *c) {
+    int code = 0;
+    sscanf(c->rbuf, "HTTP/1.%*d %d", &code);
+    return code;
+}
+
+static void client_start(int ep, client_t *c, const run_cfg_t *cfg, uint64_t t_start, run_res_t *res) {
+    c->t_start = t_start;
+    c->sent = 0;
+    c->rlen = 0;
+    if (c->fd < 0) {
+        if (client_connect(ep, c, cfg->port) < 0) { res->errors++; c->state = C_IDLE; }
+        return;
+    }
+    c->state = C_SENDING;
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLIN, .data.ptr = c};
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// A kept-alive socket the server closed before our request landed: replay the
+// request on a fresh connection, charging the reconnect to the original start.
+static int client_retry(int ep, client_t *c, const run_cfg_t *cfg, run_res_t *res) {
+    if (!c->reused || c->rlen > 0) return 0;
+    client_close(c);
+    res->reconnects++;
+    c->sent = 0;
+    if (client_connect(ep, c, cfg->port) < 0) return 0;
+    return 1;
+}
+
+static void run_one(const run_cfg_t *cfg, run_res_t *res) {
+    memset(res, 0, sizeof(*res));
+    build_request(cfg);
+    int ep = epoll_create1(0);
+    static client_t clients[MAX_CONNS];
+    int nc = cfg->conns < MAX_CONNS ? cfg->conns : MAX_CONNS;
+    for (int i = 0; i < nc; i++) { clients[i].fd = -1; clients[i].state = C_IDLE; }
+
+    uint64_t t0 = now_ns(), t_end = t0 + (uint64_t)cfg->seconds * 1000000000ull;
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    uint64_t next_send = t0;
+    int stopping = 0, busy = 0;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= t_end) stopping = 1;
+        if (stopping && busy == 0) break;
+        if (!stopping) {
+            for (int i = 0; i < nc; i++) {
+                client_t *c = &clients[i];
+                if (c->state != C_IDLE) continue;
+                if (interval) {
+                    if (next_send > now) break;
+                    client_start(ep, c, cfg, next_send, res);
+                    next_send += interval;
+                } else {
+                    client_start(ep, c, cfg, now, res);
+                }
+                if (c->state != C_IDLE) busy++;
+            }
+        }
+        int timeout = 10;
+        if (interval && !stopping) {
+            int64_t wait = (int64_t)(next_send - now_ns()) / 1000000;
+            timeout = wait < 0 ? 0 : wait < 10 ? (int)wait : 10;
+        }
+        if (stopping && now > t_end + 2000000000ull) {
+            // Give up on requests the server never answered.
+            for (int i = 0; i < nc; i++)
+                if (clients[i].state != C_IDLE) { res->errors++; client_close(&clients[i]); }
+            break;
+        }
+        struct epoll_event evs[64];
+        int n = epoll_wait(ep, evs, 64, timeout);
+        for (int k = 0; k < n; k++) {
+            client_t *c = evs[k].data.ptr;
+            if (c->state == C_CONNECTING && (evs[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0; socklen_t el = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &el);
+                if (err) { res->errors++; client_close(c); busy--; continue; }
+                c->state = C_SENDING;
+            }
+            if (c->state == C_SENDING) {
+                ssize_t w = write(c->fd, req_buf + c->sent, req_len - c->sent);
+                if (w < 0 && errno != EAGAIN) {
+                    if (client_retry(ep, c, cfg, res)) continue;
+                    res->errors++; client_close(c); busy--; continue;
+                }
+                if (w > 0) c->sent += w;
+                if (c->sent == (size_t)req_len) {
+                    c->state = C_READING;
+                    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+                    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+                continue;
+            }
+            if (c->state == C_READING) {
+                ssize_t r = read(c->fd, c->rbuf + c->rlen, RESP_BUF - 1 - c->rlen);
+                if (r < 0 && errno == EAGAIN) continue;
+                if (r <= 0 && client_retry(ep, c, cfg, res)) continue;
+                if (r > 0) c->rlen += r;
+                int done = response_complete(c);
+                if (done == 0 && r > 0) continue;
+                busy--;
+                if (done == 1) {
+                    int code = response_status(c);
+                    if (code >= 200 && code < 300) {
+                        res->ok++;
+                        hist_record(&res->hist, now_ns() - c->t_start);
+                    } else {
+                        res->errors++;
+                    }
+                } else {
+                    res->errors++;
+                }
+                // Keep the socket only if we asked for keep-alive and the server didn't hang up.
+                int keep = cfg->keepalive && done == 1 && r > 0 && !strcasestr(c->rbuf, "Connection: close");
+                if (keep) {
+                    char probe;
+                    ssize_t pr = recv(c->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+                    if (pr == 0) keep = 0;
+                }
+                if (!keep) {
+                    if (cfg->keepalive) res->reconnects++;
+                    client_close(c);
+                } else {
+                    c->state = C_IDLE;
+                    c->reused = 1;
+                }
+            }
+        }
+    }
+    res->elapsed = (now_ns() - t0) / 1e9;
+    for (int i = 0; i < nc; i++) client_close(&clients[i]);
+    close(ep);
+}
+
+// Driver under test
+// Every bus points at the driver's built-in emulators, so the run exercises the
+// real write paths with wire-time latency and no hardware.
+static pid_t driver_pid = -1;
+
+static void stop_driver(void) {
+    if (driver_pid > 0) {
+        kill(driver_pid, SIGTERM);
+        waitpid(driver_pid, NULL, 0);
+        driver_pid = -1;
+    }
+}
+
+static int start_driver(const char *path, int port) {
+    driver_pid = fork();
+    if (driver_pid < 0) return -1;
+    if (driver_pid == 0) {
+        char p[16];
+        snprintf(p, sizeof(p), "%d", port);
+        setenv("SERVER_PORT", p, 1);
+        setenv("UART_PORT", getenv_default("BENCH_UART_PORT", "emu:"), 1);
+        setenv("ICS_PORT", getenv_default("BENCH_ICS_PORT", "emu:"), 1);
+        setenv("I2C_DEV", getenv_default("BENCH_I2C_DEV", "emu:"), 1);
+        setenv("SPI_DEV", "emu:", 1);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+        execl(path, path, (char*)NULL);
+        perror("exec driver");
+        _exit(127);
+    }
+    // Wait until the listener accepts connections.
+    for (int i = 0; i < 500; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in a = {0};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(fd, (struct sockaddr*)&a, sizeof(a)) == 0;
+        close(fd);
+        if (ok) return 0;
+        usleep(10000);
+    }
+    fprintf(stderr, "driver did not start listening on port %d\n", port);
+    return -1;
+}
+
+static int endpoint_selected(const char *list, const char *name) {
+    if (!list || !*list) return 1;
+    size_t n = strlen(name);
+    for (const char *p = list; (p = strstr(p, name)); p += n)
+        if ((p == list || p[-1] == ',') && (p[n] == ',' || p[n] == 0)) return 1;
+    return 0;
+}
+
+static void print_result(const run_cfg_t *cfg, const run_res_t *r, int first) {
+    printf("%s\n    {\"endpoint\":\"%s\",\"mode\":\"%s\",\"rate\":%.0f,\"conns\":%d,\"keepalive\":%s,"
+           "\"requests\":%llu,\"errors\":%llu,\"reconnects\":%llu,\"seconds\":%.3f,\"throughput_rps\":%.1f,"
+           "\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+        first ? "" : ",", cfg->ep->path, cfg->rate > 0 ? "open" : "closed", cfg->rate,
+        cfg->conns, cfg->keepalive ? "true" : "false",
+        (unsigned long long)r->ok, (unsigned long long)r->errors, (unsigned long long)r->reconnects,
+        r->elapsed, r->elapsed > 0 ? r->ok / r->elapsed : 0.0,
+        (unsigned long long)hist_percentile(&r->hist, 50.0),
+        (unsigned long long)hist_percentile(&r->hist, 99.0),
+        (unsigned long long)hist_percentile(&r->hist, 99.9),
+        (unsigned long long)r->hist.max_us);
+}
+
+// Functional checks
+// Requests go one per connection, blocking. check_send writes raw request
+// text and returns the socket; check_reply reads the reply to EOF, leaves its
+// body in resp and returns the status code, -1 if none came back.
+static int check_send(int port, const char *req) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {0};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = {5, 0};     // a driver waiting for more input fails the check, not hangs it
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (fd < 0 || connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { if (fd >= 0) close(fd); return -1; }
+    size_t n = strlen(req);
+    if (write(fd, req, n) != (ssize_t)n) { close(fd); return -1; }
+    return fd;
+}
+
+static int check_reply(int fd, char *resp, size_t size) {
+    size_t len = 0;
+    ssize_t r;
+    resp[0] = 0;
+    if (fd < 0) return -1;
+    while (len < size - 1 && (r = read(fd, resp + len, size - 1 - len)) > 0) len += r;
+    close(fd);
+    resp[len] = 0;
+    int code = -1;
+    if (sscanf(resp, "HTTP/1.%*d %d", &code) != 1) return -1;
+    char *b = strstr(resp, "\r\n\r\n");
+    if (b) memmove(resp, b + 4, strlen(b + 4) + 1);
+    return code;
+}
+
+static int check_raw(int port, const char *req, char *resp, size_t size) {
+    return check_reply(check_send(port, req), resp, size);
+}
+
+// hdrs: extra header lines, each ending in CRLF.
+static void check_format(char *req, size_t cap, const char *method, const char *path, const char *hdrs, const char *body) {
+    snprintf(req, cap, "%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n%s"
+        "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s", method, path, hdrs, strlen(body), body);
+}
+
+static int check_request(int port, const char *method, const char *path, int client,
+                         const char *body, char *resp, size_t size) {
+    char req[1024], hdr[32] = "";
+    if (client) snprintf(hdr, sizeof(hdr), "X-Client-Id: %d\r\n", client);
+    check_format(req, sizeof(req), method, path, hdr, body);
+    return check_raw(port, req, resp, size);
+}
+
+static int check_failed;
+
+static void check(const char *what, int got, int want, const char *resp) {
+    if (got == want) return;
+    fprintf(stderr, "FAIL %s: %d, expected %d %s\n", what, got, want, resp);
+    check_failed++;
+}
+
+// Fills the /stage table from distinct clients, then lets the areas expire.
+static void check_stage(int port, int ttl_ms) {
+    static const char op[] = "{\"op\":\"pio\",\"port\":0,\"value\":1}";
+    char resp[4096], what[64];
+    int i;
+    for (i = 1; i <= 64; i++) {
+        snprintf(what, sizeof(what), "stage area %d", i);
+        check(what, check_request(port, "PUT", "/stage", i, op, resp, sizeof(resp)), 200, resp);
+    }
+    check("stage area beyond the table", check_request(port, "PUT", "/stage", i, op, resp, sizeof(resp)), 400, resp);
+    if (!strstr(resp, "Too many staging areas")) check("stage overflow error", 0, 1, resp);
+    check("DELETE frees an area", check_request(port, "DELETE", "/stage", 1, "", resp, sizeof(resp)), 204, resp);
+    check("stage into freed slot", check_request(port, "PUT", "/stage", i, op, resp, sizeof(resp)), 200, resp);
+    usleep((ttl_ms + 200) * 1000);
+    check("expired area is gone", check_request(port, "GET", "/stage", 2, "", resp, sizeof(resp)), 200, resp);
+    if (strcmp(resp, "{\"staged\":[]}") != 0) check("expired area content", 0, 1, resp);
+    check("commit after expiry", check_request(port, "POST", "/commit", 2, "", resp, sizeof(resp)), 400, resp);
+    for (i = 100; i < 164; i++) {
+        snprintf(what, sizeof(what), "stage area %d after expiry", i);
+        check(what, check_request(port, "PUT", "/stage", i, op, resp, sizeof(resp)), 200, resp);
+    }
+}
+
+// Malformed request framing gets an error reply and leaves the driver serving.
+static void check_framing(int port) {
+    static const struct { const char *length; int want; } cases[] = {
+        {"-1", 400}, {"+5", 400}, {"12abc", 400}, {"", 400},
+        {"18446744073709551615", 413}, {"99999999999999999999999", 400}, {"1000000", 413},
+    };
+    char req[256], resp[4096], what[96];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(req, sizeof(req), "POST /pio HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: %s\r\n\r\n", cases[i].length);
+        snprintf(what, sizeof(what), "Content-Length \"%s\"", cases[i].length);
+        check(what, check_raw(port, req, resp, sizeof(resp)), cases[i].want, resp);
+        snprintf(what, sizeof(what), "serving after Content-Length \"%s\"", cases[i].length);
+        check(what, check_request(port, "GET", "/boards", 0, "", resp, sizeof(resp)), 200, resp);
+    }
+}
+
+// Values the handlers must refuse rather than truncate into range.
+static void check_validation(int port) {
+    static const struct { const char *method, *path, *body; } cases[] = {
+        {"PUT", "/pwm", "{\"channel\":4294967297,\"duty\":10,\"period\":20000}"},
+        {"PUT", "/pio", "{\"port\":0,\"value\":256}"},
+        {"POST", "/uart", "{\"data\":[65,256]}"},
+        {"POST", "/uart", "{\"data\":[4294967361]}"},
+        {"PUT", "/bus", "{\"bus\":\"i2c\",\"addr\":200,\"data\":[1]}"},
+    };
+    char resp[4096];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        check(cases[i].body, check_request(port, cases[i].method, cases[i].path, 0, cases[i].body, resp, sizeof(resp)), 400, resp);
+}
+
+static long check_counter(int port, const char *name) {
+    char resp[4096], key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    if (check_request(port, "GET", "/debug/sched", 0, "", resp, sizeof(resp)) != 200) return -1;
+    char *p = strstr(resp, key);
+    return p ? strtol(p + strlen(key), NULL, 10) : -1;
+}
+
+static int check_count(const char *s, const char *what) {
+    int n = 0;
+    for (; (s = strstr(s, what)); s += strlen(what)) n++;
+    return n;
+}
+
+// A failing step rolls the steps before it back and skips the rest. The I2C
+// bus is left unopened (BENCH_I2C_DEV), so the I2C step fails.
+static void check_batch_rollback(int port) {
+    char resp[4096];
+    check("pio before batch", check_request(port, "PUT", "/pio", 0, "{\"port\":2,\"value\":1}", resp, sizeof(resp)), 204, resp);
+    check("batch with failing step", check_request(port, "POST", "/batch", 0,
+        "{\"ops\":[{\"op\":\"pio\",\"port\":2,\"value\":5},{\"op\":\"pio\",\"port\":2,\"value\":9,\"delay_ms\":50},"
+        "{\"op\":\"bus\",\"bus\":\"i2c\",\"addr\":80,\"data\":[1]},{\"op\":\"pio\",\"port\":3,\"value\":1}]}",
+        resp, sizeof(resp)), 502, resp);
+    check("batch steps rolled back", check_count(resp, "\"status\":\"rolled_back\""), 2, resp);
+    check("batch step failed", check_count(resp, "\"status\":\"failed\""), 1, resp);
+    check("batch step skipped", check_count(resp, "\"status\":\"skipped\""), 1, resp);
+}
+
+// A client heartbeating within its watchdog timeout keeps its writes while
+// another client's batch waits out a delay, and goes safe once it stops.
+static void check_batch_watchdog(int port) {
+    static const char hdrs[] = "X-Client-Id: wd-check\r\nX-Watchdog-Ms: 300\r\n";
+    char req[1024], resp[4096];
+    long trips = check_counter(port, "watchdog_trips");
+    check_format(req, sizeof(req), "PUT", "/pwm", hdrs, "{\"channel\":0,\"duty\":40,\"period\":20000}");
+    check("watchdog client pwm", check_raw(port, req, resp, sizeof(resp)), 204, resp);
+    check_format(req, sizeof(req), "POST", "/batch", "",
+        "{\"ops\":[{\"op\":\"pio\",\"port\":1,\"value\":1},{\"op\":\"pio\",\"port\":1,\"value\":2,\"delay_ms\":1500}]}");
+    int batch = check_send(port, req);
+    check_format(req, sizeof(req), "PUT", "/watchdog", hdrs, "");
+    for (uint64_t end = now_ns() + 2000000000ull; now_ns() < end; usleep(100000))
+        check("heartbeat", check_raw(port, req, resp, sizeof(resp)), 204, resp);
+    check("delayed batch", check_reply(batch, resp, sizeof(resp)), 200, resp);
+    check("no watchdog trip while heartbeating", check_counter(port, "watchdog_trips"), trips, "");
+    usleep(600000);
+    check("watchdog trip once quiet", check_counter(port, "watchdog_trips"), trips + 1, "");
+}
+
+// UDP setpoints: stale seqs are dropped until the sender sets the reset flag.
+static void check_udp(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in a = {0};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (fd < 0 || connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { check("udp socket", -1, 0, ""); return; }
+    static const struct { uint32_t seq; int flags, applied, stale; } cases[] = {
+        {100, 0, 1, 0}, {5, 0, 0, 1}, {5, 1, 1, 0}, {6, 0, 1, 0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        // header, then one PIO op on board 0, port 0
+        uint8_t pkt[20] = {'K', 'U', 1, 1, 0, 0, 0, 0, 1, cases[i].flags, 0, 0, 3, 0, 0, 0, (uint8_t)i, 0, 0, 0};
+        uint8_t ack[64];
+        for (int b = 0; b < 4; b++) pkt[4 + b] = cases[i].seq >> (8 * b);
+        char what[64];
+        snprintf(what, sizeof(what), "udp seq %u flags %d", cases[i].seq, cases[i].flags);
+        if (send(fd, pkt, sizeof(pkt), 0) != sizeof(pkt) || recv(fd, ack, sizeof(ack), 0) < 12) { check(what, -1, 0, "no ack"); continue; }
+        check(what, ack[8] * 10 + ack[9], cases[i].applied * 10 + cases[i].stale, "(applied * 10 + stale)");
+    }
+    close(fd);
+}
+
+static int run_checks(const char *driver, int port) {
+    int ttl_ms = 300;
+    char ttl[16], udp[16];
+    snprintf(ttl, sizeof(ttl), "%d", ttl_ms);
+    snprintf(udp, sizeof(udp), "%d", port + 1);
+    setenv("STAGE_TTL_MS", ttl, 1);
+    setenv("UDP_PORT", udp, 1);
+    setenv("BENCH_I2C_DEV", "/nonexistent/i2c", 1);
+    if (start_driver(driver, port) < 0) { stop_driver(); return 1; }
+    check_framing(port);
+    check_validation(port);
+    check_batch_rollback(port);
+    check_batch_watchdog(port);
+    check_udp(port + 1);
+    check_stage(port, ttl_ms);
+    stop_driver();
+    fprintf(stderr, check_failed ? "%d checks failed\n" : "all checks passed\n", check_failed);
+    return check_failed ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        return run_checks(argc > 2 ? argv[2] : "./driver", getenv_int("BENCH_PORT", 18080));
+    }
+    const char *driver = argc > 1 ? argv[1] : "./driver";
+    int port = getenv_int("BENCH_PORT", 18080);
+    int seconds = getenv_int("BENCH_SECONDS", 2);
+    const char *conns_list = getenv_default("BENCH_CONNS", "1,4,16");
+    double rate = getenv_int("BENCH_RATE", 2000);
+    const char *ep_list = getenv("BENCH_ENDPOINTS");
+
+    signal(SIGPIPE, SIG_IGN);
+    if (start_driver(driver, port) < 0) { stop_driver(); return 1; }
+
+    int conns[16], nconns = 0;
+    for (const char *p = conns_list; *p && nconns < 16; ) {
+        int v = atoi(p);
+        if (v > 0) conns[nconns++] = v > MAX_CONNS ? MAX_CONNS : v;
+        p = strchr(p, ',');
+        if (!p) break;
+        p++;
+    }
+
+    time_t wall = time(NULL);
+    printf("{\n  \"version\":\"%s\",\"timestamp\":%lld,\"nproc\":%ld,\"seconds\":%d,\n  \"results\":[",
+        BENCH_VERSION, (long long)wall, sysconf(_SC_NPROCESSORS_ONLN), seconds);
+    int first = 1;
+    for (size_t e = 0; e < N_ENDPOINTS; e++) {
+        if (!endpoint_selected(ep_list, endpoints[e].name)) continue;
+        for (int ci = 0; ci < nconns; ci++) {
+            for (int ka = 0; ka < 2; ka++) {
+                for (int mode = 0; mode < (rate > 0 ? 2 : 1); mode++) {
+                    run_cfg_t cfg = {&endpoints[e], conns[ci], ka, mode ? rate : 0, seconds, port};
+                    run_res_t res;
+                    run_one(&cfg, &res);
+                    print_result(&cfg, &res, first);
+                    first = 0;
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    stop_driver();
+    return 0;
+}
@@ -3,35 +3,132 @@
  * Implements an HTTP server providing browser/CLI-accessible endpoints
  * for direct control and monitoring of the KCB-5 over UART/I2C/SPI/ICS.
  * All configuration is via environment variables.
+ * - CONFIG_FILE: KEY=VALUE file of the same variables, applied over the
+ *   environment; re-read on SIGHUP or when the file changes. Limits, caps,
+ *   timeouts, watchdogs, debounce, baud, SPI and scheduler settings apply live;
+ *   listeners, boards, pools, SHM, RT and history need a restart
  * - SERVER_HOST: address to bind (default: "0.0.0.0")
- * - SERVER_PORT: port to bind (default: "8080")
+ * - SERVER_PORT: port to bind, 0 for none with UNIX_SOCKET (default: "8080")
+ * - UNIX_SOCKET: also serve on a Unix socket path, or "@name" (abstract);
+ *   UNIX_SOCKET_MODE (default: 0660) and UNIX_ALLOW_UIDS restrict peers
  * - UART_PORT: UART device (e.g. "/dev/ttyS1")
- * - UART_BAUD: UART baudrate (default: 115200)
+ * - UART_BAUD: UART and ICS line rate in bits per second, standard or not
+ *   (default: 115200); UART_VMIN, UART_VTIME set those termios fields
+ *   (default: 0, 0); UART_LOW_LATENCY sets ASYNC_LOW_LATENCY where the port
+ *   supports it (default: 1)
  * - I2C_DEV: I2C device (e.g. "/dev/i2c-1")
  * - SPI_DEV: SPI device (e.g. "/dev/spidev0.0")
+ * - SPI_MODE, SPI_SPEED_HZ: SPI mode and clock (default: 0, 1000000)
  * - ICS_PORT: ICS serial port (e.g. "/dev/ttyS2")
+ *   Any bus device may be "emu:" (UART/ICS: "emu:<script>") for the built-in
+ *   emulators; EMU_I2C_HZ, EMU_SPI_HZ and EMU_SPI_FLASH_KB tune their timing.
+ * - SCHED_TICK_US: bus scheduler tick; writes to the same PIO port, PWM/DAC
+ *   channel or servo within one tick are collapsed (default: 1000)
+ * - STATUS_POLL_MS: status poll period over UART_PORT, 0 disables (default: 100)
+ * - STATUS_TIMEOUT_MS: status reply timeout; the bus worker is not held up
+ *   waiting for the reply (default: 50)
+ * - HISTORY_FILE: memory-mapped status history ring, served at /status/history
+ * - HISTORY_SAMPLES: history ring capacity in samples (default: 262144)
+ *   (bulk columnar export at /status/history/export)
+ * - PIO_GPIO: local GPIO inputs reported as edges, "/dev/gpiochipN:off,off,..."
+ *   (the board's DIP inputs are always reported, at STATUS_POLL_MS resolution)
+ * - PIO_DEBOUNCE_US: input edge debounce window (default: 2000)
+ * - UDP_PORT: binary setpoint datagrams with sequence numbers, 0 for off
+ *   (default: 0); UDP_WATCHDOG_MS stops a silent client's motion (default: 250)
+ * - WATCHDOG_MS: servos, PWM channels and PIO ports not written again within
+ *   this go to their safe state, 0 for off (default: 0)
+ * - CLIENT_WATCHDOG_MS: dead-man timeout for requests with X-Client-Id (or
+ *   X-Watchdog-Ms per request); PUT /watchdog is a heartbeat (default: 500)
+ * - SAFE_SERVO: "free" or "hold" (default: free); PWM safe state is duty 0
+ * - SAFE_PIO_MASK, SAFE_PIO_VALUE: PIO bits forced, and to what (default: 0xff, 0)
+ * - SHM_NAME: shared-memory status/command channel for local clients, e.g.
+ *   "/kcb5" (see kcb5_shm.h); SHM_MODE sets its permissions (default: 0660)
+ * - RT: real-time mode, mlockall plus SCHED_FIFO bus threads (default: 0)
+ * - RT_PRIO: SCHED_FIFO priority of the bus workers (default: 80)
+ * - RT_BUS_CPUS, RT_NET_CPUS: CPU lists ("0,2-3") for bus threads and the
+ *   HTTP loop
+ * - READ_TIMEOUT_MS: time to receive a whole request once it starts, answered
+ *   with 408 (default: 10000); IDLE_TIMEOUT_MS closes idle keep-alive
+ *   connections (default: 60000); WRITE_TIMEOUT_MS drops a client that stops
+ *   reading its reply (default: 30000); 0 disables each
+ * - MAX_CONNS, MAX_CONNS_PER_IP: connection caps (default: 256, 64); MAX_CONNS
+ *   also sizes the connection pool, each with a SEND_BUF_KB output buffer
+ *   (default: 16, larger replies spill to the heap) and a REQ_ARENA_KB
+ *   request scratch arena (default: 24)
+ * - RATE_MOTION, RATE_STATUS, RATE_ADMIN: request rate limits per route class,
+ *   "<per second>[/<burst>]" (default: none)
+ * - SHED_QUEUE_DEPTH, SHED_LAG_MS: bus queue depth and queueing delay beyond
+ *   which status reads are shed with 503 (default: 256, 50)
+ * - BUS_RETRY_MAX_MS: buses are opened in the background and retried with
+ *   backoff up to this (default: 5000), and reopened when a device is lost;
+ *   GET /healthz and /readyz report their state, /readyz with 503 until every
+ *   configured bus is up
+ * - BUS_DOWN: "hold" keeps writes for a lost bus up to BUS_HOLD_MS and replays
+ *   them once it is back, "fail" refuses them with 503 (default: hold, 1000)
+ * - JOURNAL_DIR: append-only binary log of every command each board's worker
+ *   handles, in memory-mapped segments of JOURNAL_SEGMENT_MB (default: 16),
+ *   keeping the newest JOURNAL_SEGMENTS (default: 8)
+ * - REPLAY: comma-separated journal segments to re-issue on the configured
+ *   buses instead of serving HTTP, with the original timing divided by
+ *   REPLAY_SPEED (default: 1, 0 for back to back)
+ * - SEQUENCE_DIR: keep the programs uploaded to /sequences there (one
+ *   <name>.json each) and load them at startup (default: memory only)
+ * - STAGE_TTL_MS: drop a /stage area not written to for this long, 0 keeps
+ *   them until commit or DELETE (default: 30000)
+ * - TRACE: start with request tracing enabled (default: 0)
+ * - BOARD<n>_ID, BOARD<n>_UART_PORT, _UART_BAUD, _I2C_DEV, _SPI_DEV, _SPI_MODE,
+ *   _SPI_SPEED_HZ, _ICS_PORT, _HISTORY_FILE: drive several boards (n = 0, 1, ...) from one process,
+ *   each served under /boards/<id>/; unprefixed endpoints go to the first
  * Only those buses actually used by driver are required.
+ *
+ * Build with `make`; `make bench` runs the load-test suite in bench.c and
+ * `make check` its functional checks.
  */
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <poll.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <zlib.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <linux/spi/spidev.h>
+#include <linux/serial.h>
+#include <linux/gpio.h>
+#include "kcb5_shm.h"
 
 #define MAX_REQ_SIZE 4096
-#define MAX_RESP_SIZE 8192
 #define UART_BUF_SIZE 1024
 
 // Util functions for env config
@@ -44,30 +141,589 @@ static int getenv_int(const char *k, int def) {
     return v ? atoi(v) : def;
 }
 
+// CONFIG_FILE holds KEY=VALUE lines named like the environment variables ('#'
+// starts a comment line). Its entries override the environment at startup and
+// again on every reload; a key deleted from the file keeps its last value.
+static int config_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[512];
+    int n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *k = line + strspn(line, " \t"), *eq = strchr(k, '='), *end;
+        if (*k == '#' || !eq) continue;
+        for (end = eq; end > k && (end[-1] == ' ' || end[-1] == '\t'); end--);
+        *end = 0;
+        char *v = eq + 1 + strspn(eq + 1, " \t");
+        for (end = v + strcspn(v, "\r\n"); end > v && (end[-1] == ' ' || end[-1] == '\t'); end--);
+        *end = 0;
+        if (*k && setenv(k, v, 1) == 0) n++;
+    }
+    fclose(f);
+    return n;
+}
+
+// Splits path into its directory (for an inotify watch) and returns the basename.
+static const char *path_split(const char *path, char *dir, size_t cap) {
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, cap, "%.*s", slash ? (int)(slash - path) + (slash == path) : 1, slash ? path : ".");
+    return slash ? slash + 1 : path;
+}
+
+// Little-endian fields of the UDP datagrams and compiled sequences.
+static uint16_t get_le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t get_le32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+static void put_le16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_le32(uint8_t *p, uint32_t v) { put_le16(p, v); put_le16(p + 2, v >> 16); }
+
+// Tracing
+// Every thread owns a single-writer ring of completed spans. /debug/trace reads
+// all rings without locking and re-reads the head afterwards to drop slots that
+// were overwritten during the copy. With tracing off a span costs one relaxed load.
+// USDT probes (provider "kcb5") fire regardless of the runtime switch.
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, req, arg) DTRACE_PROBE2(kcb5, name, req, arg)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, req, arg) do {} while (0)
+#endif
+
+#define TRACE_RING_SIZE 4096
+
+enum { TR_ACCEPT, TR_RECV, TR_PARSE, TR_DISPATCH, TR_BUS_ENQUEUE, TR_BUS, TR_SEND, TR_KINDS };
+static const char *trace_names[TR_KINDS] = {
+    "accept", "recv", "parse", "dispatch", "bus_enqueue", "bus", "send"
+};
+
+typedef struct {
+    uint64_t ts, dur;   // CLOCK_MONOTONIC ns
+    uint32_t req;
+    uint16_t kind, arg;
+} trace_ev_t;
+
+typedef struct trace_ring {
+    _Atomic uint64_t head;
+    int tid;
+    struct trace_ring *next;
+    trace_ev_t ev[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static atomic_int trace_on;
+static _Atomic(trace_ring_t*) trace_rings;
+static __thread trace_ring_t *trace_self;
+static __thread uint32_t trace_req;     // request the current thread works for
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static trace_ring_t *trace_ring_self(void) {
+    if (!trace_self) {
+        trace_ring_t *r = calloc(1, sizeof(*r));
+        if (!r) return NULL;
+        r->tid = (int)syscall(SYS_gettid);
+        r->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r));
+        trace_self = r;
+    }
+    return trace_self;
+}
+
+static inline uint64_t trace_begin(void) {
+    if (__builtin_expect(!atomic_load_explicit(&trace_on, memory_order_relaxed), 1)) return 0;
+    return now_ns();
+}
+static void trace_end(int kind, uint64_t t0, unsigned arg) {
+    if (!t0) return;
+    trace_ring_t *r = trace_ring_self();
+    if (!r) return;
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_ev_t *e = &r->ev[h & (TRACE_RING_SIZE-1)];
+    e->ts = t0; e->dur = now_ns() - t0;
+    e->req = trace_req; e->kind = kind; e->arg = arg;
+    atomic_store_explicit(&r->head, h+1, memory_order_release);
+}
+
+// Span helpers: TRACE_BEGIN declares the start timestamp, TRACE_END records it.
+#define TRACE_BEGIN(t, probe) \
+    uint64_t t = trace_begin(); TRACE_PROBE(probe##_start, trace_req, 0)
+#define TRACE_END(t, probe, kind, arg) \
+    do { TRACE_PROBE(probe##_end, trace_req, (arg)); trace_end(kind, t, arg); } while (0)
+
+// Render all rings as Chrome trace-event JSON into a malloc'd buffer.
+static char *trace_dump(size_t *len) {
+    size_t cap = 4096, n = 0;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    n += snprintf(out, cap, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int first = 1;
+    trace_ev_t *copy = malloc(sizeof(trace_ev_t) * TRACE_RING_SIZE);
+    if (!copy) { free(out); return NULL; }
+    for (trace_ring_t *r = atomic_load(&trace_rings); r; r = r->next) {
+        uint64_t h1 = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t lo = h1 > TRACE_RING_SIZE ? h1 - TRACE_RING_SIZE : 0;
+        for (uint64_t i = lo; i < h1; i++) copy[i - lo] = r->ev[i & (TRACE_RING_SIZE-1)];
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t h2 = atomic_load_explicit(&r->head, memory_order_relaxed);
+        // The writer may be filling slot h2 right now, which aliases h2-SIZE.
+        uint64_t valid = h2 >= TRACE_RING_SIZE ? h2 - TRACE_RING_SIZE + 1 : 0;
+        for (uint64_t i = lo > valid ? lo : valid; i < h1; i++) {
+            trace_ev_t *e = &copy[i - lo];
+            if (cap - n < 256) {
+                char *g = realloc(out, cap *= 2);
+                if (!g) { free(out); free(copy); return NULL; }
+                out = g;
+            }
+            n += snprintf(out + n, cap - n,
+                "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"req\":%u,\"arg\":%u}}",
+                first ? "" : ",", e->kind < TR_KINDS ? trace_names[e->kind] : "?",
+                e->ts / 1000.0, e->dur / 1000.0, r->tid, e->req, e->arg);
+            first = 0;
+        }
+    }
+    free(copy);
+    if (cap - n < 4) {
+        char *g = realloc(out, cap + 4);
+        if (!g) { free(out); return NULL; }
+        out = g;
+    }
+    n += snprintf(out + n, 4, "]}");
+    *len = n;
+    return out;
+}
+
+// Bus emulators
+// In-process device models selected with an "emu:" device path, so the driver
+// can run, be soak-tested and benchmarked without hardware.
+// - UART/ICS: the driver gets the slave side of a pty pair; a far-end thread on
+//   the master paces traffic at the configured baud rate and answers frames from
+//   a script ("emu:/path/to/script", or the built-in default for the port).
+// - I2C: 128 addresses x 256 byte register maps with auto-increment pointer.
+// - SPI: NOR flash model (READ/PP/SE/CE/RDSR/WREN/RDID) with program/erase busy time.
+// Transfers sleep for the time the transaction would take on the wire.
+#define EMU_MAX_RULES 64
+#define EMU_MAX_FRAME 32
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+// Sleeps until an absolute now_ns() time, so periodic loops do not drift.
+static void sleep_until_ns(uint64_t t) {
+    struct timespec ts = {t / 1000000000ull, t % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Termios constant for a rate in bits per second, 0 (B0) if it has none.
+static speed_t baud_code(int bps) {
+    static const struct { speed_t code; int bps; } tab[] = {
+        {B1200, 1200}, {B2400, 2400}, {B4800, 4800}, {B9600, 9600}, {B19200, 19200},
+        {B38400, 38400}, {B57600, 57600}, {B115200, 115200}, {B230400, 230400},
+        {B460800, 460800}, {B500000, 500000}, {B576000, 576000}, {B921600, 921600},
+        {B1000000, 1000000}, {B1152000, 1152000}, {B1500000, 1500000},
+        {B2000000, 2000000}, {B2500000, 2500000}, {B3000000, 3000000},
+        {B3500000, 3500000}, {B4000000, 4000000},
+    };
+    for (size_t i = 0; i < sizeof(tab)/sizeof(tab[0]); i++)
+        if (tab[i].bps == bps) return tab[i].code;
+    return B0;
+}
+
+// UART far end. A script line is "<pattern> => <reply> [@delay_ms]":
+// pattern bytes are hex ("80"), hex/mask ("80/e0") or "??"; reply bytes are hex,
+// "$n" (request byte n) or "$n&mm". Frames that match no rule lose their first byte.
+typedef struct {
+    int plen, rlen, delay_ms;
+    uint8_t pval[EMU_MAX_FRAME], pmask[EMU_MAX_FRAME];
+    int8_t rsrc[EMU_MAX_FRAME];             // -1: literal rval, else request byte index
+    uint8_t rval[EMU_MAX_FRAME];
+} emu_rule_t;
+
+typedef struct uart_emu {
+    int master, baud;
+    pthread_t thr;
+    atomic_int stop;                        // uart_emu_close: exit once the slave is closed
+    int nrules;
+    emu_rule_t rules[EMU_MAX_RULES];
+} uart_emu_t;
+
+// ICS 3.5 position command: CMD(0x80|id) POS_H POS_L, echoed with bit 7 cleared.
+static const char emu_ics_script[] = "80/e0 ?? ?? => $0&7f $1 $2\n";
+// KCB-5 status request, answered with a fixed status frame.
+static const char emu_kcb_script[] =
+    "a5 01 00 01 => a5 81 12 00 7b 00 ea 01 59 01 c8 05 0d 00 00 03 e8 00 00 07 d0 ef\n";
+
+static int emu_parse_script(uart_emu_t *e, const char *text) {
+    char line[256];
+    e->nrules = 0;
+    while (*text) {
+        size_t n = strcspn(text, "\n");
+        snprintf(line, sizeof(line), "%.*s", (int)n, text);
+        text += n + (text[n] == '\n');
+        char *hash = strchr(line, '#'); if (hash) *hash = 0;
+        char *arrow = strstr(line, "=>");
+        if (!arrow) continue;
+        *arrow = 0;
+        if (e->nrules >= EMU_MAX_RULES) return -1;
+        emu_rule_t *r = &e->rules[e->nrules];
+        memset(r, 0, sizeof(*r));
+        char *save, *tok;
+        for (tok = strtok_r(line, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+            if (r->plen >= EMU_MAX_FRAME) return -1;
+            unsigned v = 0, m = 0xff;
+            if (strcmp(tok, "??") == 0) m = 0;
+            else if (sscanf(tok, "%x/%x", &v, &m) < 1) return -1;
+            r->pval[r->plen] = v & m; r->pmask[r->plen++] = m;
+        }
+        for (tok = strtok_r(arrow + 2, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+            if (tok[0] == '@') { r->delay_ms = atoi(tok + 1); continue; }
+            if (r->rlen >= EMU_MAX_FRAME) return -1;
+            unsigned v = 0, m = 0xff;
+            if (tok[0] == '$') {
+                int idx = 0;
+                if (sscanf(tok, "$%d&%x", &idx, &m) < 1 || idx >= r->plen) return -1;
+                r->rsrc[r->rlen] = idx; r->rval[r->rlen++] = m;
+            } else {
+                if (sscanf(tok, "%x", &v) != 1) return -1;
+                r->rsrc[r->rlen] = -1; r->rval[r->rlen++] = v;
+            }
+        }
+        if (r->plen > 0) e->nrules++;
+    }
+    return 0;
+}
+
+// 0: no rule can match yet, 1: matched rule *out, -1: buffer is a prefix of some rule
+static int emu_match(uart_emu_t *e, const uint8_t *buf, int len, emu_rule_t **out) {
+    int partial = 0;
+    for (int i = 0; i < e->nrules; i++) {
+        emu_rule_t *r = &e->rules[i];
+        int k, n = len < r->plen ? len : r->plen;
+        for (k = 0; k < n; k++)
+            if ((buf[k] & r->pmask[k]) != r->pval[k]) break;
+        if (k < n) continue;
+        if (len >= r->plen) { *out = r; return 1; }
+        partial = 1;
+    }
+    return partial ? -1 : 0;
+}
+
+// Time on the wire for n bytes of 8N1.
+static uint64_t emu_line_ns(uart_emu_t *e, size_t n) {
+    return e->baud > 0 ? (uint64_t)n * 10 * 1000000000ull / e->baud : 0;
+}
+
+static void *uart_emu_thread(void *arg) {
+    uart_emu_t *e = arg;
+    uint8_t in[EMU_MAX_FRAME * 4];
+    int len = 0;
+    while (1) {
+        struct pollfd pfd = {.fd = e->master, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0) continue;
+        if ((pfd.revents & POLLHUP) && atomic_load(&e->stop)) break;
+        if (pfd.revents & POLLHUP) { sleep_ns(10000000); continue; }   // no slave open yet
+        uint8_t chunk[256];
+        ssize_t n = read(e->master, chunk, sizeof(chunk));
+        if (n <= 0) continue;
+        sleep_ns(emu_line_ns(e, n));     // receive at line rate; backpressure fills the pty
+        for (ssize_t i = 0; i < n; i++) {
+            if (len == (int)sizeof(in)) { memmove(in, in + 1, --len); }
+            in[len++] = chunk[i];
+            emu_rule_t *r;
+            int m;
+            while (len > 0 && (m = emu_match(e, in, len, &r)) != -1) {
+                if (m == 0) { memmove(in, in + 1, --len); continue; }
+                uint8_t out[EMU_MAX_FRAME];
+                for (int k = 0; k < r->rlen; k++)
+                    out[k] = r->rsrc[k] < 0 ? r->rval[k] : in[(int)r->rsrc[k]] & r->rval[k];
+                if (r->delay_ms) sleep_ns((uint64_t)r->delay_ms * 1000000);
+                sleep_ns(emu_line_ns(e, r->rlen));
+                // A reader that never drains its side gets an overrun, not a stalled far end.
+                if (r->rlen && write(e->master, out, r->rlen) < 0 && errno != EAGAIN) break;
+                len -= r->plen;
+                memmove(in, in + r->plen, len);
+            }
+        }
+    }
+    close(e->master);
+    free(e);
+    return NULL;
+}
+
+// Ends the far end of a pty pair whose slave side the driver has closed; the
+// thread frees e.
+static void uart_emu_close(uart_emu_t *e) {
+    atomic_store(&e->stop, 1);
+}
+
+// Opens a pty pair, returns the slave fd for the driver and runs the far end on the master.
+static int uart_emu_open(uart_emu_t **out, const char *script, const char *def_script, int baud) {
+    uart_emu_t *e = calloc(1, sizeof(*e));
+    if (!e) return -1;
+    e->baud = baud;
+    char *text = NULL;
+    if (script && *script) {
+        FILE *f = fopen(script, "r");
+        if (!f) { free(e); return -1; }
+        size_t cap = 0;
+        if (getdelim(&text, &cap, 0, f) < 0) { free(text); text = NULL; }
+        fclose(f);
+    }
+    int bad = emu_parse_script(e, text ? text : def_script);
+    free(text);
+    if (bad) { free(e); return -1; }
+    e->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    char name[64];
+    if (e->master < 0 || grantpt(e->master) < 0 || unlockpt(e->master) < 0 ||
+        ptsname_r(e->master, name, sizeof(name)) != 0) {
+        if (e->master >= 0) close(e->master);
+        free(e); return -1;
+    }
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0 || pthread_create(&e->thr, NULL, uart_emu_thread, e) != 0) {
+        if (fd >= 0) close(fd);
+        close(e->master); free(e); return -1;
+    }
+    pthread_detach(e->thr);
+    *out = e;
+    return fd;
+}
+
+// I2C register-map model
+typedef struct {
+    pthread_mutex_t lock;
+    int hz;
+    uint8_t ptr[128];
+    uint8_t regs[128][256];
+} i2c_emu_t;
+
+static int i2c_emu_xfer(i2c_emu_t *e, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    if (addr < 0 || addr > 127) { errno = ENXIO; return -1; }
+    // START + address + data bytes, 9 clocks per byte, repeated START for the read phase.
+    uint64_t bits = (txlen ? 9 * (1 + txlen) : 0) + (rxlen ? 9 * (1 + rxlen) : 0) + 2;
+    sleep_ns(bits * 1000000000ull / e->hz);
+    pthread_mutex_lock(&e->lock);
+    if (txlen > 0) {
+        e->ptr[addr] = tx[0];
+        for (size_t i = 1; i < txlen; i++) e->regs[addr][e->ptr[addr]++] = tx[i];
+    }
+    for (size_t i = 0; i < rxlen; i++) rx[i] = e->regs[addr][e->ptr[addr]++];
+    pthread_mutex_unlock(&e->lock);
+    return (int)(rxlen ? rxlen : txlen);
+}
+
+// SPI NOR flash model
+#define FLASH_PAGE 256
+#define FLASH_SECTOR 4096
+typedef struct {
+    pthread_mutex_t lock;
+    int hz;
+    uint32_t size;
+    int wel;                    // write enable latch
+    uint64_t busy_until;        // WIP while now_ns() < busy_until
+    uint8_t *mem;
+} spi_emu_t;
+
+static uint32_t flash_addr(const uint8_t *tx, size_t txlen) {
+    return txlen >= 4 ? (uint32_t)tx[1] << 16 | tx[2] << 8 | tx[3] : 0;
+}
+
+static int spi_emu_xfer(spi_emu_t *e, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    (void)addr;
+    if (txlen == 0) return 0;
+    sleep_ns((uint64_t)(txlen + rxlen) * 8 * 1000000000ull / e->hz);
+    pthread_mutex_lock(&e->lock);
+    int busy = now_ns() < e->busy_until;
+    uint32_t a = flash_addr(tx, txlen) % e->size;
+    switch (tx[0]) {
+    case 0x06: e->wel = 1; break;                                   // WREN
+    case 0x04: e->wel = 0; break;                                   // WRDI
+    case 0x05:                                                      // RDSR
+        for (size_t i = 0; i < rxlen; i++) rx[i] = (busy ? 1 : 0) | (e->wel ? 2 : 0);
+        break;
+    case 0x9f: {                                                    // RDID
+        uint8_t id[3] = {0xef, 0x40, (uint8_t)(__builtin_ctz(e->size))};
+        for (size_t i = 0; i < rxlen; i++) rx[i] = i < 3 ? id[i] : 0;
+        break;
+    }
+    case 0x03:                                                      // READ
+        for (size_t i = 0; i < rxlen; i++) rx[i] = busy ? 0xff : e->mem[(a + i) % e->size];
+        break;
+    case 0x02:                                                      // PP: wraps within the page
+        if (busy || !e->wel || txlen < 4) break;
+        for (size_t i = 4; i < txlen; i++) {
+            uint32_t p = (a & ~(FLASH_PAGE-1)) | ((a + i - 4) & (FLASH_PAGE-1));
+            e->mem[p] &= tx[i];
+        }
+        e->wel = 0; e->busy_until = now_ns() + 700000;              // tPP 0.7 ms
+        break;
+    case 0x20:                                                      // SE 4K
+        if (busy || !e->wel || txlen < 4) break;
+        memset(e->mem + (a & ~(FLASH_SECTOR-1)), 0xff, FLASH_SECTOR);
+        e->wel = 0; e->busy_until = now_ns() + 45000000;            // tSE 45 ms
+        break;
+    case 0xc7:                                                      // CE
+        if (busy || !e->wel) break;
+        memset(e->mem, 0xff, e->size);
+        e->wel = 0; e->busy_until = now_ns() + (uint64_t)e->size / FLASH_SECTOR * 45000000;
+        break;
+    default:
+        for (size_t i = 0; i < rxlen; i++) rx[i] = 0xff;
+    }
+    pthread_mutex_unlock(&e->lock);
+    return (int)(rxlen ? rxlen : txlen);
+}
+
+// Bus backends
+// I2C and SPI transfers go through an ops table so a handle can be backed by
+// the /dev node or by the emulator. UART and ICS emulators hand the driver a pty,
+// so those keep plain read/write on the fd either way.
+typedef struct bus_ops {
+    const char *name;
+    int (*xfer)(void *h, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen);
+} bus_ops_t;
+
+static int is_emu(const char *dev) {
+    return strncmp(dev, "emu:", 4) == 0;
+}
+
 // UART
+// Rates are plain bits per second; one without a Bnnn constant is set with
+// termios2/BOTHER. Reads are non-blocking, so VMIN/VTIME only decide when
+// poll() reports input: with VTIME 0, not before VMIN bytes are in (keep it
+// at most the shortest reply). ASYNC_LOW_LATENCY makes the serial driver
+// push received bytes at once rather than on its next tick; ports without
+// TIOCSSERIAL (ptys, some USB adapters) go without. A write larger than the
+// TX queue allowance goes out in chunks paced on TIOCOUTQ: once the driver
+// holds that much, the writer sleeps for the excess's time on the wire, so
+// the line stays busy without a long queue building up in front of the next
+// short frame. The allowance is about UART_TX_QUEUE_US of line time.
+// Interrupted writes and waits are retried. A write that fails after part of
+// the data went out returns the count sent and marks the handle torn: the
+// board is then left inside a frame, so the worker drops the line like a lost
+// one, and reopening it gives the board's receiver time to discard the partial
+// frame.
+#ifndef BOTHER
+// <asm/termbits.h> cannot be included alongside <termios.h>.
+#define BOTHER 0010000
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+#endif
+#define UART_TX_QUEUE_US 2000
+
+typedef struct {
+    int baud;                   // bits per second
+    int vmin, vtime, low_latency;
+} uart_cfg_t;
+
 typedef struct {
     int fd;
+    int baud;
+    size_t txq;                 // bytes uart_write lets queue in the driver
+    int torn;                   // a write stopped part-way through
+    uart_emu_t *emu;
 } uart_handle_t;
 
-static int uart_open(uart_handle_t *h, const char *dev, int baud) {
-    h->fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (h->fd < 0) return -1;
+// Applies tio with the given rate; TCSADRAIN lets a frame being sent finish first.
+static int uart_set_speed(int fd, struct termios *tio, int bps) {
+    speed_t code = baud_code(bps);
+    if (code != B0) {
+        cfsetispeed(tio, code);
+        cfsetospeed(tio, code);
+        return tcsetattr(fd, TCSADRAIN, tio);
+    }
+    struct termios2 t2;
+    if (bps <= 0 || tcsetattr(fd, TCSADRAIN, tio) < 0 || ioctl(fd, TCGETS2, &t2) < 0) return -1;
+    t2.c_cflag = (t2.c_cflag & ~CBAUD) | BOTHER;
+    t2.c_ispeed = t2.c_ospeed = bps;
+    return ioctl(fd, TCSETSW2, &t2);
+}
+
+static void uart_low_latency(int fd, int on) {
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) < 0) return;
+    int flags = on ? ss.flags | ASYNC_LOW_LATENCY : ss.flags & ~ASYNC_LOW_LATENCY;
+    if (flags == ss.flags) return;
+    ss.flags = flags;
+    if (ioctl(fd, TIOCSSERIAL, &ss) < 0 && on) perror("ASYNC_LOW_LATENCY");
+}
+
+// (Re)applies the line settings in place.
+static int uart_configure(uart_handle_t *h, const uart_cfg_t *cfg) {
+    struct termios tio;
+    if (h->fd <= 0 || tcgetattr(h->fd, &tio) < 0) return -1;
+    tio.c_cc[VMIN] = cfg->vmin;
+    tio.c_cc[VTIME] = cfg->vtime;
+    if (uart_set_speed(h->fd, &tio, cfg->baud) < 0) return -1;
+    uart_low_latency(h->fd, cfg->low_latency);
+    h->baud = cfg->baud;
+    h->txq = (uint64_t)cfg->baud * UART_TX_QUEUE_US / 10000000;
+    if (h->txq < 64) h->txq = 64;
+    if (h->emu) h->emu->baud = cfg->baud;
+    return 0;
+}
+static int uart_setup(uart_handle_t *h, const uart_cfg_t *cfg) {
     struct termios tio;
     memset(&tio, 0, sizeof(tio));
     tio.c_cflag = CS8 | CLOCAL | CREAD;
     tio.c_iflag = IGNPAR;
     tio.c_oflag = 0;
     tio.c_lflag = 0;
-    cfsetispeed(&tio, baud);
-    cfsetospeed(&tio, baud);
+    cfsetispeed(&tio, B9600);   // replaced by uart_configure
+    cfsetospeed(&tio, B9600);
     tcflush(h->fd, TCIFLUSH);
-    if (tcsetattr(h->fd, TCSANOW, &tio) < 0) {
-        close(h->fd); h->fd = -1; return -2;
+    if (tcsetattr(h->fd, TCSANOW, &tio) < 0 || uart_configure(h, cfg) < 0) {
+        close(h->fd); h->fd = -1;
+        if (h->emu) { uart_emu_close(h->emu); h->emu = NULL; }
+        return -2;
     }
     return 0;
 }
+static int uart_open_script(uart_handle_t *h, const char *dev, const uart_cfg_t *cfg, const char *def_script) {
+    if (is_emu(dev)) h->fd = uart_emu_open(&h->emu, dev + 4, def_script, cfg->baud);
+    else h->fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (h->fd < 0) return -1;
+    return uart_setup(h, cfg);
+}
+static int uart_open(uart_handle_t *h, const char *dev, const uart_cfg_t *cfg) {
+    return uart_open_script(h, dev, cfg, emu_kcb_script);
+}
 static ssize_t uart_write(uart_handle_t *h, const void *buf, size_t len) {
-    return write(h->fd, buf, len);
+    TRACE_BEGIN(t0, uart_write);
+    const uint8_t *p = buf;
+    size_t off = 0;
+    while (off < len) {
+        size_t n = len - off;
+        int queued = 0;
+        if (n > h->txq) {
+            n = h->txq;
+            if (off && h->baud > 0 && ioctl(h->fd, TIOCOUTQ, &queued) == 0 && queued + n > h->txq)
+                sleep_ns((uint64_t)(queued + n - h->txq) * 10000000000ull / h->baud);
+        }
+        ssize_t r = write(h->fd, p + off, n);
+        if (r > 0) { off += r; continue; }
+        if (r < 0 && errno == EINTR) continue;
+        struct pollfd pfd = {.fd = h->fd, .events = POLLOUT};
+        if (r == 0) { errno = EIO; break; }
+        if (errno != EAGAIN) break;
+        while ((r = poll(&pfd, 1, 1000)) < 0 && errno == EINTR) {}
+        if (r == 0) errno = EAGAIN;
+        if (r <= 0) break;
+        if (!(pfd.revents & POLLOUT)) { errno = EIO; break; }    // hangup
+    }
+    TRACE_END(t0, uart_write, TR_BUS, len);
+    if (off < len && off > 0) h->torn = 1;
+    return off || !len ? (ssize_t)off : -1;
 }
 static ssize_t uart_read(uart_handle_t *h, void *buf, size_t len) {
     return read(h->fd, buf, len);
@@ -76,246 +732,4672 @@ static ssize_t uart_read(uart_handle_t *h, void *buf, size_t len) {
 // I2C
 typedef struct {
     int fd;
+    const bus_ops_t *ops;
+    i2c_emu_t *emu;
 } i2c_handle_t;
 
+static int i2c_dev_xfer(void *hp, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    i2c_handle_t *h = hp;
+    if (rxlen == 0) {
+        if (ioctl(h->fd, I2C_SLAVE, addr) < 0) return -1;
+        return write(h->fd, tx, txlen);
+    }
+    struct i2c_msg msgs[2] = {
+        {.addr = addr, .flags = 0, .len = txlen, .buf = (uint8_t*)tx},
+        {.addr = addr, .flags = I2C_M_RD, .len = rxlen, .buf = rx},
+    };
+    struct i2c_rdwr_ioctl_data xfer = {txlen ? msgs : msgs + 1, txlen ? 2 : 1};
+    return ioctl(h->fd, I2C_RDWR, &xfer) < 0 ? -1 : (int)rxlen;
+}
+static int i2c_emu_ops_xfer(void *hp, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    return i2c_emu_xfer(((i2c_handle_t*)hp)->emu, addr, tx, txlen, rx, rxlen);
+}
+static const bus_ops_t i2c_dev_ops = {"dev", i2c_dev_xfer};
+static const bus_ops_t i2c_emu_ops = {"emu", i2c_emu_ops_xfer};
+
 static int i2c_open(i2c_handle_t *h, const char *dev) {
+    if (is_emu(dev)) {
+        h->emu = calloc(1, sizeof(i2c_emu_t));
+        if (!h->emu) return -1;
+        pthread_mutex_init(&h->emu->lock, NULL);
+        h->emu->hz = getenv_int("EMU_I2C_HZ", 100000);
+        h->ops = &i2c_emu_ops;
+        h->fd = INT32_MAX;      // not a real fd, only marks the bus as present
+        return 0;
+    }
     h->fd = open(dev, O_RDWR);
     if (h->fd < 0) return -1;
+    h->ops = &i2c_dev_ops;
     return 0;
 }
 static int i2c_write(i2c_handle_t *h, int addr, const void *buf, size_t len) {
-    if (ioctl(h->fd, I2C_SLAVE, addr) < 0) return -1;
-    return write(h->fd, buf, len);
+    TRACE_BEGIN(t0, i2c_write);
+    int r = h->ops->xfer(h, addr, buf, len, NULL, 0);
+    TRACE_END(t0, i2c_write, TR_BUS, len);
+    return r;
 }
 
 // SPI
 typedef struct {
     int fd;
+    const bus_ops_t *ops;
+    spi_emu_t *emu;
 } spi_handle_t;
 
-static int spi_open(spi_handle_t *h, const char *dev) {
+static int spi_dev_xfer(void *hp, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    spi_handle_t *h = hp;
+    (void)addr;
+    if (rxlen == 0) return write(h->fd, tx, txlen);
+    struct spi_ioc_transfer t[2];
+    memset(t, 0, sizeof(t));
+    t[0].tx_buf = (uintptr_t)tx; t[0].len = txlen;
+    t[1].rx_buf = (uintptr_t)rx; t[1].len = rxlen;
+    return ioctl(h->fd, SPI_IOC_MESSAGE(2), t) < 0 ? -1 : (int)rxlen;
+}
+static int spi_emu_ops_xfer(void *hp, int addr, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) {
+    return spi_emu_xfer(((spi_handle_t*)hp)->emu, addr, tx, txlen, rx, rxlen);
+}
+static const bus_ops_t spi_dev_ops = {"dev", spi_dev_xfer};
+static const bus_ops_t spi_emu_ops = {"emu", spi_emu_ops_xfer};
+
+// The emulated part clocks at EMU_SPI_HZ if set, else at the configured speed.
+static int spi_configure(spi_handle_t *h, int mode, int speed) {
+    if (h->emu) {
+        pthread_mutex_lock(&h->emu->lock);
+        h->emu->hz = getenv_int("EMU_SPI_HZ", speed);
+        pthread_mutex_unlock(&h->emu->lock);
+        return 0;
+    }
+    uint8_t m = mode & 3, bits = 8;
+    uint32_t hz = speed;
+    if (ioctl(h->fd, SPI_IOC_WR_MODE, &m) < 0 || ioctl(h->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(h->fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0) return -1;
+    return 0;
+}
+static int spi_open(spi_handle_t *h, const char *dev, int mode, int speed) {
+    if (is_emu(dev)) {
+        spi_emu_t *e = calloc(1, sizeof(*e));
+        if (!e) return -1;
+        pthread_mutex_init(&e->lock, NULL);
+        e->hz = getenv_int("EMU_SPI_HZ", speed);
+        e->size = 1u << (10 + 31 - __builtin_clz(getenv_int("EMU_SPI_FLASH_KB", 1024) | 4));
+        e->mem = malloc(e->size);
+        if (!e->mem) { free(e); return -1; }
+        memset(e->mem, 0xff, e->size);
+        h->emu = e;
+        h->ops = &spi_emu_ops;
+        h->fd = INT32_MAX;
+        return 0;
+    }
     h->fd = open(dev, O_RDWR);
     if (h->fd < 0) return -1;
-    uint8_t mode = SPI_MODE_0;
-    uint8_t bits = 8;
-    uint32_t speed = 1000000;
-    ioctl(h->fd, SPI_IOC_WR_MODE, &mode);
-    ioctl(h->fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-    ioctl(h->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+    h->ops = &spi_dev_ops;
+    spi_configure(h, mode, speed);
     return 0;
 }
 static int spi_write(spi_handle_t *h, const void *buf, size_t len) {
-    return write(h->fd, buf, len);
+    TRACE_BEGIN(t0, spi_write);
+    int r = h->ops->xfer(h, 0, buf, len, NULL, 0);
+    TRACE_END(t0, spi_write, TR_BUS, len);
+    return r;
 }
 
 // ICS (Servo) - just use UART for ICS port
 typedef uart_handle_t ics_handle_t;
-#define ics_open uart_open
+static int ics_open(ics_handle_t *h, const char *dev, const uart_cfg_t *cfg) {
+    return uart_open_script(h, dev, cfg, emu_ics_script);
+}
 #define ics_write uart_write
 
-// HTTP utility
-static void send_response(int fd, const char *status, const char *ctype, const char *body) {
-    char buf[MAX_RESP_SIZE];
-    int n = snprintf(buf, sizeof(buf),
-        "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nAccess-Control-Allow-Origin: *\r\n\r\n%s",
-        status, ctype, strlen(body), body);
-    write(fd, buf, n);
+// KCB-5 board frames (UART): A5 CMD LEN payload[LEN] SUM, SUM = CMD+LEN+payload mod 256
+#define KCB_STX 0xa5
+#define KCB_CMD_STATUS 0x01     // reply: AD[4] (BE16), DIP mask, LED mask, timer[2] (BE32)
+#define KCB_CMD_PIO 0x10        // port, value
+#define KCB_CMD_PWM 0x11        // channel, duty %, period us (BE16)
+#define KCB_CMD_DAC 0x12        // channel, value (BE16)
+
+#define PIO_PORTS 8
+#define PWM_CHANNELS 8
+#define DAC_CHANNELS 4
+#define ICS_IDS 32
+#define KCB_STATUS_LEN 18
+
+static int kcb_frame(uint8_t *out, int cmd, const uint8_t *payload, int len) {
+    uint8_t sum = cmd + len;
+    out[0] = KCB_STX; out[1] = cmd; out[2] = len;
+    for (int i = 0; i < len; i++) { out[3+i] = payload[i]; sum += payload[i]; }
+    out[3+len] = sum;
+    return len + 4;
+}
+
+// Status snapshot
+// Filled by the status poller through the bus worker; /status renders the latest one.
+typedef struct {
+    uint64_t ts_ms;             // wall clock
+    uint16_t ad[4];
+    uint8_t dip, led;           // one bit per switch / LED
+    uint16_t reserved;
+    uint32_t timer[2];
+    uint32_t reserved2;
+} status_sample_t;
+_Static_assert(sizeof(status_sample_t) == 32, "history file layout");
+
+// Flat channel view of a sample, used for history downsampling and export.
+#define STATUS_CHANNELS 14
+static const char *status_channel_names[STATUS_CHANNELS] = {
+    "ad0", "ad1", "ad2", "ad3", "dip0", "dip1", "dip2", "dip3",
+    "led0", "led1", "led2", "led3", "timer0", "timer1"
+};
+static int64_t status_channel(const status_sample_t *s, int ch) {
+    if (ch < 4) return s->ad[ch];
+    if (ch < 8) return (s->dip >> (ch - 4)) & 1;
+    if (ch < 12) return (s->led >> (ch - 8)) & 1;
+    return s->timer[ch - 12];
 }
-static void send_json(int fd, const char *body) {
-    send_response(fd, "200 OK", "application/json", body);
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t version;
+    status_sample_t cur;
+} status_t;
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
-static void send_204(int fd) {
-    send_response(fd, "204 No Content", "text/plain", "");
+
+static int status_parse(const uint8_t *f, int len, status_sample_t *out) {
+    if (len < KCB_STATUS_LEN + 4 || f[0] != KCB_STX || f[1] != (KCB_CMD_STATUS | 0x80) || f[2] != KCB_STATUS_LEN)
+        return -1;
+    uint8_t sum = f[1] + f[2];
+    for (int i = 0; i < KCB_STATUS_LEN; i++) sum += f[3+i];
+    if (sum != f[3+KCB_STATUS_LEN]) return -1;
+    const uint8_t *p = f + 3;
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < 4; i++) out->ad[i] = p[2*i] << 8 | p[2*i+1];
+    out->dip = p[8]; out->led = p[9];
+    for (int i = 0; i < 2; i++)
+        out->timer[i] = (uint32_t)p[10+4*i] << 24 | p[11+4*i] << 16 | p[12+4*i] << 8 | p[13+4*i];
+    out->ts_ms = wall_ms();
+    return 0;
 }
-static void send_400(int fd, const char *msg) {
-    char buf[256];
-    snprintf(buf, sizeof(buf), "{\"error\":\"%s\"}", msg);
-    send_response(fd, "400 Bad Request", "application/json", buf);
+
+// Seqlock publish into a shared-memory region (see kcb5_shm.h); bus worker only.
+static void shm_publish(kcb5_shm_t *m, const status_sample_t *smp, uint64_t version) {
+    uint32_t seq = atomic_load_explicit(&m->status_seq, memory_order_relaxed);
+    atomic_store_explicit(&m->status_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    m->status = (kcb5_status_t){.version = version, .ts_ms = smp->ts_ms, .dip = smp->dip, .led = smp->led,
+        .ad = {smp->ad[0], smp->ad[1], smp->ad[2], smp->ad[3]}, .timer = {smp->timer[0], smp->timer[1]}};
+    atomic_store_explicit(&m->status_seq, seq + 2, memory_order_release);
+}
+
+// Status history
+// Fixed-size ring of samples in a memory-mapped file, so it survives restarts.
+// The bus worker appends; readers copy without locking and drop slots the
+// writer may have lapped meanwhile. Dirty pages are handed to the kernel with an
+// async msync every HISTORY_SYNC samples, never an fsync per sample.
+#define HISTORY_MAGIC 0x5453494835424b43ull     // "KCB5HIST"
+#define HISTORY_VERSION 1
+#define HISTORY_SYNC 64
+#define HISTORY_MAX_POINTS 10000
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version, sample_size;
+    uint64_t capacity;
+    _Atomic uint64_t head;      // samples ever written
+    uint8_t pad[32];
+} history_hdr_t;
+
+typedef struct {
+    history_hdr_t *hdr;
+    status_sample_t *ring;
+    size_t map_len;
+    uint64_t capacity;
+} history_t;
+
+static history_t *history_open(const char *path, uint64_t capacity) {
+    if (capacity < 2) return NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+    size_t len = sizeof(history_hdr_t) + capacity * sizeof(status_sample_t);
+    struct stat st;
+    int fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != len;
+    if (fresh && ftruncate(fd, 0) < 0) { close(fd); return NULL; }
+    if (fresh && ftruncate(fd, len) < 0) { close(fd); return NULL; }
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return NULL;
+    history_t *h = calloc(1, sizeof(*h));
+    if (!h) { munmap(m, len); return NULL; }
+    h->hdr = m;
+    h->ring = (status_sample_t*)((char*)m + sizeof(history_hdr_t));
+    h->map_len = len;
+    h->capacity = capacity;
+    if (fresh || h->hdr->magic != HISTORY_MAGIC || h->hdr->version != HISTORY_VERSION ||
+        h->hdr->sample_size != sizeof(status_sample_t) || h->hdr->capacity != capacity) {
+        memset(h->hdr, 0, sizeof(*h->hdr));
+        h->hdr->version = HISTORY_VERSION;
+        h->hdr->sample_size = sizeof(status_sample_t);
+        h->hdr->capacity = capacity;
+        h->hdr->magic = HISTORY_MAGIC;
+    }
+    return h;
+}
+
+static void history_append(history_t *h, const status_sample_t *s) {
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_relaxed);
+    h->ring[head % h->capacity] = *s;
+    atomic_store_explicit(&h->hdr->head, head + 1, memory_order_release);
+    if ((head + 1) % HISTORY_SYNC == 0) msync(h->hdr, h->map_len, MS_ASYNC);
 }
-static void send_404(int fd) {
-    send_response(fd, "404 Not Found", "application/json", "{\"error\":\"Not found\"}");
+
+// Oldest index still safe to read: the writer may be filling slot head right now.
+static uint64_t history_oldest(history_t *h) {
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+    return head >= h->capacity ? head - h->capacity + 1 : 0;
 }
-static void send_405(int fd) {
-    send_response(fd, "405 Method Not Allowed", "application/json", "{\"error\":\"Method not allowed\"}");
+
+// Copies sample i; returns 0 if it was overwritten during the copy.
+static int history_get(history_t *h, uint64_t i, status_sample_t *out) {
+    *out = h->ring[i % h->capacity];
+    atomic_thread_fence(memory_order_acquire);
+    return i >= history_oldest(h);
 }
 
-// HTTP parsing
-static int parse_http_request(const char *req, char *method, char *path, char *body) {
-    sscanf(req, "%s %s", method, path);
-    char *b = strstr(req, "\r\n\r\n");
-    if (b && strlen(b+4) < MAX_REQ_SIZE-1)
-        strcpy(body, b+4);
-    else
-        body[0]=0;
+// First index in [oldest, head) whose timestamp is >= ts.
+static uint64_t history_seek(history_t *h, uint64_t ts) {
+    uint64_t lo = history_oldest(h), hi = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+    status_sample_t s;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (!history_get(h, mid, &s) || s.ts_ms < ts) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Real-time mode
+// RT=1 locks all memory, keeps malloc from handing pages back, and runs each
+// board's bus worker (RT_PRIO) and status poller (RT_PRIO - 1) under
+// SCHED_FIFO, pinned to RT_BUS_CPUS; the HTTP loop is pinned to RT_NET_CPUS.
+// CPU lists are "0,2-3". Wake-up lateness of the bus tick and status poll is
+// kept per board as a log2 histogram and shown in /debug/sched.
+#define RT_STACK_PREFAULT (256 * 1024)
+#define JITTER_BUCKETS 24      // bucket k: lateness < 2^k us
+
+static struct {
+    int enabled, prio;
+    int bus_cpus_set, net_cpus_set;
+    cpu_set_t bus_cpus, net_cpus;
+} rt;
+
+typedef struct {
+    _Atomic uint64_t n, sum_ns, max_ns;
+    _Atomic uint32_t hist[JITTER_BUCKETS];
+} jitter_t;
+
+static void jitter_record(jitter_t *j, uint64_t late_ns) {
+    uint64_t us = late_ns / 1000;
+    int k = us ? 64 - __builtin_clzll(us) : 0;
+    if (k >= JITTER_BUCKETS) k = JITTER_BUCKETS - 1;
+    atomic_fetch_add_explicit(&j->hist[k], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&j->n, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&j->sum_ns, late_ns, memory_order_relaxed);
+    if (late_ns > atomic_load_explicit(&j->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&j->max_ns, late_ns, memory_order_relaxed);
+}
+
+// Upper bound in us of the bucket holding the q-quantile, capped at the max.
+static uint64_t jitter_quantile(jitter_t *j, double q) {
+    uint64_t n = atomic_load(&j->n), seen = 0, max = atomic_load(&j->max_ns) / 1000;
+    for (int k = 0; k < JITTER_BUCKETS && n; k++) {
+        seen += atomic_load(&j->hist[k]);
+        if (seen >= q * n) return (1ull << k) < max ? 1ull << k : max;
+    }
     return 0;
 }
 
-// Main endpoint logic
+static int parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    if (!list) return 0;
+    for (const char *p = list; *p; ) {
+        char *end;
+        long a = strtol(p, &end, 10), b = a;
+        if (end == p) return 0;
+        if (*end == '-') { p = end + 1; b = strtol(p, &end, 10); if (end == p) return 0; }
+        for (long c = a; c <= b && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        p = end + (*end == ',');
+    }
+    return CPU_COUNT(set) > 0;
+}
 
-// /status - GET
-static void handle_status(int fd) {
-    // For demonstration, dummy data. Real code would poll device over UART/SPI/I2C/ICS.
-    // For example, send a status request over UART and parse reply.
-    char json[256];
-    snprintf(json, sizeof(json),
-        "{\"ad\":[123,234,345,456],\"dip\":[1,0,1,0],\"led\":[1,0,1,1],\"timer\":[1000,2000]}"
-    );
-    send_json(fd, json);
+static void rt_init(void) {
+    rt.enabled = getenv_int("RT", 0) != 0;
+    rt.prio = getenv_int("RT_PRIO", 80);
+    rt.bus_cpus_set = parse_cpus(getenv("RT_BUS_CPUS"), &rt.bus_cpus);
+    rt.net_cpus_set = parse_cpus(getenv("RT_NET_CPUS"), &rt.net_cpus);
+    if (!rt.enabled) return;
+    // Freed memory stays mapped (and locked) instead of faulting back in later.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) perror("mlockall");
 }
 
-// /rom - PUT
-static void handle_rom(int fd, const char *body) {
-    // Expects {"cmd":"write"/"erase","data":"..."}
-    // Send write/erase command to ROM over UART/I2C/SPI
-    // For demo: just succeed
-    send_204(fd);
+// Called by each bus thread on start; prio_drop lowers it below the worker.
+static void rt_thread_setup(int prio_drop) {
+    if (rt.bus_cpus_set && pthread_setaffinity_np(pthread_self(), sizeof(rt.bus_cpus), &rt.bus_cpus) != 0)
+        fprintf(stderr, "rt: cannot pin bus thread\n");
+    if (!rt.enabled) return;
+    struct sched_param sp = {.sched_priority = rt.prio - prio_drop};
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (err) fprintf(stderr, "rt: SCHED_FIFO %d: %s\n", sp.sched_priority, strerror(err));
+    // Touch the stack now so the first deep call path does not page-fault.
+    volatile char stack[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
 }
 
-// /dac - PUT
-static void handle_dac(int fd, const char *body) {
-    // Expects {"value":1234}
-    // Map to DAC write over UART/I2C/SPI
-    send_204(fd);
+static void rt_net_setup(void) {
+    if (rt.net_cpus_set && pthread_setaffinity_np(pthread_self(), sizeof(rt.net_cpus), &rt.net_cpus) != 0)
+        fprintf(stderr, "rt: cannot pin network thread\n");
 }
 
-// /bus - PUT
-static void handle_bus(int fd, const char *body, i2c_handle_t *i2c, spi_handle_t *spi) {
-    // Expects {"bus":"i2c"/"spi", "addr":..., "data":[...]}
-    // Parse JSON, write to bus
-    char bus[8];
-    int addr = 0;
-    int data[32], n = 0;
-    if (sscanf(body, "{\"bus\":\"%7[^\"]\",\"addr\":%d,\"data\":[%n", bus, &addr, &n) >= 2) {
-        int d[32], nd=0, x;
-        const char *p = body + n;
-        while (sscanf(p, "%d%n", &x, &n) == 1) {
-            d[nd++] = x;
-            p += n;
-            if (*p != ',') break; p++;
-        }
-        if (strcmp(bus,"i2c")==0 && i2c && i2c->fd>0) {
-            uint8_t buf[32]; for(int i=0;i<nd;i++) buf[i]=d[i];
-            i2c_write(i2c, addr, buf, nd);
-        } else if (strcmp(bus,"spi")==0 && spi && spi->fd>0) {
-            uint8_t buf[32]; for(int i=0;i<nd;i++) buf[i]=d[i];
-            spi_write(spi, buf, nd);
-        }
-        send_204(fd);
-        return;
+// Event loop hand-off
+// Other threads never touch connections; they queue a post_t for the HTTP
+// event loop (loop_post) or just wake it to re-check shared flags (loop_wake).
+typedef struct post {
+    struct post *next;
+    void (*fn)(void *arg);
+    void *arg;
+} post_t;
+static void loop_post(post_t *p);
+static void loop_wake(void);
+
+// Timer wheel
+// Hashed wheel of one-millisecond slots: a timer sits in the slot of its expiry
+// tick modulo WHEEL_SLOTS, so arming and cancelling are O(1) list operations
+// and advancing the clock only visits the slots it passed over. A timer more
+// than a turn ahead just stays in its slot until its tick comes round. Each
+// wheel belongs to one thread.
+#define WHEEL_SLOTS 256
+
+typedef struct wtimer {
+    struct wtimer *prev, *next;     // NULL when not armed
+    uint64_t expires;               // tick (ms)
+    void (*fn)(struct wtimer *t);
+    void *arg;
+} wtimer_t;
+
+typedef struct {
+    uint64_t now;                   // last tick run
+    uint64_t soonest;               // no timer expires before this tick
+    size_t count;
+    wtimer_t slot[WHEEL_SLOTS];     // list heads
+} twheel_t;
+
+static uint64_t wheel_tick(void) { return now_ns() / 1000000; }
+
+static void twheel_init(twheel_t *w) {
+    w->now = wheel_tick();
+    w->soonest = UINT64_MAX;
+    for (int i = 0; i < WHEEL_SLOTS; i++) w->slot[i].prev = w->slot[i].next = &w->slot[i];
+}
+
+static void twheel_del(twheel_t *w, wtimer_t *t) {
+    if (!t->next) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    w->count--;
+}
+
+// (Re)arms t to fire no sooner than ms from now (and within a tick of that).
+static void twheel_add(twheel_t *w, wtimer_t *t, uint64_t ms) {
+    twheel_del(w, t);
+    t->expires = wheel_tick() + ms + 1;
+    if (t->expires <= w->now) t->expires = w->now + 1;
+    wtimer_t *h = &w->slot[t->expires % WHEEL_SLOTS];
+    t->next = h; t->prev = h->prev;
+    h->prev->next = t; h->prev = t;
+    w->count++;
+    if (t->expires < w->soonest) w->soonest = t->expires;
+}
+
+// Fires the timers that are due. A slot is moved to a private list first, so
+// callbacks may freely arm and cancel timers, including ones in that slot.
+static void twheel_run(twheel_t *w) {
+    uint64_t to = wheel_tick();
+    uint64_t tick = to - w->now > WHEEL_SLOTS ? to - WHEEL_SLOTS : w->now;
+    while (w->count && tick < to) {
+        wtimer_t *h = &w->slot[++tick % WHEEL_SLOTS];
+        if (h->next == h) continue;
+        wtimer_t pending;
+        pending.next = h->next; pending.prev = h->prev;
+        pending.next->prev = pending.prev->next = &pending;
+        h->prev = h->next = h;
+        while (pending.next != &pending) {
+            wtimer_t *t = pending.next;
+            pending.next = t->next; t->next->prev = &pending;
+            t->next = h; t->prev = h->prev;
+            h->prev->next = t; h->prev = t;
+            if (t->expires <= to) { twheel_del(w, t); t->fn(t); }
+        }
+    }
+    w->now = to;
+    // The first occupied slot bounds the next expiry; it may be early for a
+    // timer a turn or more ahead, never late.
+    w->soonest = UINT64_MAX;
+    for (tick = to + 1; w->count && tick <= to + WHEEL_SLOTS; tick++) {
+        wtimer_t *h = &w->slot[tick % WHEEL_SLOTS];
+        if (h->next != h) { w->soonest = tick; break; }
     }
-    send_400(fd, "Invalid JSON or bus");
 }
 
-// /servo - PUT
-static void handle_servo(int fd, const char *body, ics_handle_t *ics) {
-    // Expects {"id":1,"pos":1500,"param":0}
-    // Send ICS protocol packet over ICS UART
-    send_204(fd);
+// Ms until twheel_run may have something to fire, -1 with no timers.
+static int twheel_next_ms(twheel_t *w) {
+    if (!w->count) return -1;
+    uint64_t now = wheel_tick();
+    return w->soonest > now ? (int)(w->soonest - now) : 0;
 }
 
-// /uart - POST
-static void handle_uart(int fd, const char *body, uart_handle_t *uart) {
-    // Expects {"data":[...]}
-    int n=0, x, ndata=0;
-    const char *p = strstr(body, "\"data\":[");
-    if (!p) { send_400(fd, "Missing data"); return; }
-    p += strlen("\"data\":[");
-    uint8_t buf[UART_BUF_SIZE];
-    while (sscanf(p, "%d%n", &x, &n) == 1) {
-        buf[ndata++] = x;
-        p += n;
-        if (*p != ',') break; p++;
-    }
-    if (uart && uart->fd>0) uart_write(uart, buf, ndata);
-    send_204(fd);
+// Bus scheduler
+// Device writes are queued to one bus worker thread that owns the handles.
+// Once per tick the worker takes the whole queue, collapses writes to the same
+// target so only the latest survives, drops writes equal to the shadow copy
+// of what the device already holds (unless forced) and issues the rest in order.
+enum { CMD_UART, CMD_I2C, CMD_SPI, CMD_SERVO, CMD_PIO, CMD_PWM, CMD_DAC, CMD_BATCH, CMD_STATUS, CMD_HEARTBEAT, CMD_CONFIG, CMD_ATTACH, CMD_SEQ, CMD_COMMIT, CMD_KINDS };
+static const char *cmd_names[CMD_KINDS] = {"uart", "bus", "bus", "servo", "pio", "pwm", "dac", "batch", "status", "heartbeat", "config", "attach", "sequence", "commit"};
+
+struct batch;
+struct seq_run;
+struct stage;
+
+typedef struct bus_cmd {
+    struct bus_cmd *next;
+    int kind, target, force, dropped;
+    int32_t v[2];               // servo: pos; pio: value; pwm: duty, period; dac: value
+    uint32_t req;               // trace request id
+    uint32_t client;            // watchdog owner, 0: none
+    int client_ms;              // its dead-man timeout
+    uint64_t t_submit;          // for the queue lag admission control looks at
+    struct batch *batch;        // CMD_BATCH: owned by the submitter
+    struct seq_run *run;        // CMD_SEQ: likewise
+    struct stage *stage;        // CMD_COMMIT: likewise
+    size_t len;                 // raw writes: data bytes
+    uint8_t data[];
+} bus_cmd_t;
+
+typedef struct {
+    int valid;
+    int32_t v[2];
+} shadow_t;
+
+// Bus settings of a board; CMD_CONFIG carries a new set to the worker.
+typedef struct {
+    uart_cfg_t uart;            // UART and ICS
+    int spi_mode, spi_speed;
+    int tick_us, poll_ms, poll_timeout_ms;
+} bus_cfg_t;
+
+// A configured bus device. It is opened in the background and handed to the
+// worker with CMD_ATTACH, so the worker stays the only user of the handles.
+enum { BUS_UART, BUS_I2C, BUS_SPI, BUS_ICS, BUS_KINDS };
+static const char *bus_names[BUS_KINDS] = {"uart", "i2c", "spi", "ics"};
+enum { LINK_ABSENT, LINK_OPENING, LINK_UP, LINK_DOWN };
+static const char *link_state_names[] = {"absent", "opening", "up", "down"};
+
+typedef struct {
+    const char *path;           // NULL: not configured
+    int kind;
+    _Atomic int state;
+    _Atomic int failures, err;  // failed attempts so far and errno of the last
+    _Atomic int losses;         // times the worker found the device gone
+    uint64_t lost_ns;
+    pthread_mutex_t lock;       // with cond, wakes the link thread on LINK_DOWN
+    pthread_cond_t cond;
+    struct bus_sched *sched;
+} bus_link_t;
+
+typedef struct {
+    bus_link_t *link;
+    union { uart_handle_t uart; i2c_handle_t i2c; spi_handle_t spi; } h;
+} bus_attach_t;
+
+// Watchdog state of one servo, PWM channel or PIO port.
+typedef struct {
+    wtimer_t timer;             // WATCHDOG_MS since the last write
+    uint32_t owner;             // client that wrote it last, 0: none
+    int32_t period;             // PWM: last period written
+    int kind, target;
+} wd_target_t;
+
+#define WD_CLIENT_BUCKETS 64
+
+typedef struct bus_sched {
+    const char *id;             // board id, routed as /boards/{id}/...
+    pthread_mutex_t lock;
+    int wake, sleeping;         // eventfd the idle worker polls, and whether it is
+    bus_cmd_t *head, *tail;
+    int depth;
+    _Atomic uint64_t lag_ns;    // queueing delay of the oldest command in the last tick
+    bus_cfg_t cfg;              // written by the worker once started, but for poll_ms
+    pthread_mutex_t cfg_lock;   // held to write cfg, and by other threads to copy it
+    pthread_t thr;
+    uart_handle_t *uart; i2c_handle_t *i2c; spi_handle_t *spi; ics_handle_t *ics;
+    bus_link_t link[BUS_KINDS];
+    // worker-only state
+    shadow_t pio[PIO_PORTS], pwm[PWM_CHANNELS], dac[DAC_CHANNELS];
+    shadow_t servo[ICS_IDS];    // last position sent, for batch rollback only
+    twheel_t wheel;
+    bus_cmd_t *held, **held_tail;   // writes waiting for their bus to come back
+    int held_n, replay;
+    wtimer_t hold_timer, link_timer;
+    wd_target_t wd_servo[ICS_IDS], wd_pwm[PWM_CHANNELS], wd_pio[PIO_PORTS];
+    struct wd_client *wd_clients[WD_CLIENT_BUCKETS];
+    // status polling
+    status_t status;
+    atomic_int status_changed;  // set by the worker, consumed by the event loop
+    uint8_t rx[2 * (KCB_STATUS_LEN + 4)];  // worker only: UART input not yet matched
+    size_t rx_len;
+    int rx_wait;                // a status request is out, its reply not yet in
+    wtimer_t rx_timer;          // STATUS_TIMEOUT_MS for that reply
+    uint64_t rx_replies;        // status replies taken so far
+    history_t *hist;
+    struct journal *jnl;        // JOURNAL_DIR log, if any
+    kcb5_shm_t *shm;            // SHM_NAME region, if any
+    atomic_int poll_inflight;
+    int dip_input;              // first of its DIP inputs in pio_in
+    // counters, read racily by /debug/sched
+    _Atomic uint64_t submitted, coalesced, suppressed, issued, errors, ticks, watchdog_trips, poll_timeouts;
+    jitter_t tick_jitter, poll_jitter;
+} bus_sched_t;
+
+// Batches: an ordered list of commands the worker runs back to back. A step
+// with a delay waits on the worker's wheel and the batch picks up from there,
+// so the worker serves other clients, sequences and watchdogs meanwhile (their
+// writes may land between such steps). The first failing step stops the batch and PIO/PWM/DAC steps
+// already applied are written back to their previous shadow values, servo
+// steps to the position last sent to that servo. A target whose previous value
+// is unknown (never written since startup or since its bus came back) has
+// nothing to go back to and keeps what the batch wrote. A request
+// spanning boards is split into one part per board, each running on its own
+// worker and rolled back on its own.
+#define BATCH_MAX_OPS 64
+#define BATCH_MAX_DELAY_MS 10000
+
+enum { STEP_PENDING, STEP_OK, STEP_SUPPRESSED, STEP_FAILED, STEP_SKIPPED, STEP_ROLLED_BACK };
+static const char *batch_status_names[] = {"pending", "ok", "suppressed", "failed", "skipped", "rolled_back"};
+
+typedef struct {
+    bus_cmd_t *cmd;
+    int delay_ms, status;
+    uint32_t bus_us;
+    shadow_t prev;              // shadow (servo: position) before this step, for rollback
+    bus_sched_t *board;
+    int index;                  // parts: step in the request batch
+} batch_step_t;
+
+typedef struct batch {
+    int n, failed;              // failed: index of the failing step or -1
+    struct batch *parent;       // parts: the request batch
+    int pending;                // request batch: parts still running
+    uint64_t t_submit;
+    void *owner;                // connection waiting for the results
+    post_t done;                // parts: posted to the event loop when the worker is finished
+    int next, waited;           // worker: step to run next, and whether its delay is over
+    wtimer_t timer;             // worker's wheel: that delay
+    batch_step_t step[BATCH_MAX_OPS];
+} batch_t;
+
+static batch_t *batch_new(void) {
+    batch_t *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->failed = -1;
+    return b;
 }
+// Commands are built on the loop (or UDP/shm) thread and freed by a worker, so
+// small ones are recycled through a shared free list rather than the heap. The
+// list is capped so a burst does not pin its memory for good.
+#define BUS_CMD_POOLED 64           // data bytes a recycled command holds
+#define BUS_CMD_POOL_MAX 4096
 
-// /pwm - PUT
-static void handle_pwm(int fd, const char *body) {
-    // Expects {"channel":1,"duty":50,"period":20000}
-    send_204(fd);
+static struct {
+    pthread_mutex_t lock;
+    bus_cmd_t *free;
+    int n;
+} cmd_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static bus_cmd_t *bus_cmd_new(int kind, int target, size_t len) {
+    bus_cmd_t *c = NULL;
+    if (len <= BUS_CMD_POOLED) {
+        pthread_mutex_lock(&cmd_pool.lock);
+        if ((c = cmd_pool.free)) { cmd_pool.free = c->next; cmd_pool.n--; }
+        pthread_mutex_unlock(&cmd_pool.lock);
+    }
+    if (c) memset(c, 0, sizeof(*c));
+    else if (!(c = calloc(1, sizeof(*c) + (len <= BUS_CMD_POOLED ? BUS_CMD_POOLED : len)))) return NULL;
+    c->kind = kind; c->target = target; c->len = len;
+    c->req = trace_req;
+    return c;
 }
 
-// /pio - PUT
-static void handle_pio(int fd, const char *body) {
-    // Expects {"port":1,"value":1}
-    send_204(fd);
+static void bus_cmd_free(bus_cmd_t *c) {
+    if (!c) return;
+    if (c->len <= BUS_CMD_POOLED) {
+        pthread_mutex_lock(&cmd_pool.lock);
+        if (cmd_pool.n < BUS_CMD_POOL_MAX) {
+            c->next = cmd_pool.free;
+            cmd_pool.free = c;
+            cmd_pool.n++;
+            c = NULL;
+        }
+        pthread_mutex_unlock(&cmd_pool.lock);
+    }
+    free(c);
 }
 
-// Main HTTP dispatch
-static void handle_client(int cfd, uart_handle_t *uart, i2c_handle_t *i2c, spi_handle_t *spi, ics_handle_t *ics) {
-    char req[MAX_REQ_SIZE], method[8], path[64], body[MAX_REQ_SIZE];
-    int n = read(cfd, req, sizeof(req)-1); req[n>=0?n:0]=0;
-    parse_http_request(req, method, path, body);
+static void batch_free(batch_t *b) {
+    for (int i = 0; i < b->n; i++) bus_cmd_free(b->step[i].cmd);
+    free(b);
+}
 
-    if (strcmp(path, "/status")==0 && strcmp(method,"GET")==0) {
-        handle_status(cfd);
-    } else if (strcmp(path,"/rom")==0 && strcmp(method,"PUT")==0) {
-        handle_rom(cfd, body);
-    } else if (strcmp(path,"/dac")==0 && strcmp(method,"PUT")==0) {
-        handle_dac(cfd, body);
-    } else if (strcmp(path,"/bus")==0 && strcmp(method,"PUT")==0) {
-        handle_bus(cfd, body, i2c, spi);
-    } else if (strcmp(path,"/servo")==0 && strcmp(method,"PUT")==0) {
-        handle_servo(cfd, body, ics);
-    } else if (strcmp(path,"/uart")==0 && strcmp(method,"POST")==0) {
-        handle_uart(cfd, body, uart);
-    } else if (strcmp(path,"/pwm")==0 && strcmp(method,"PUT")==0) {
-        handle_pwm(cfd, body);
-    } else if (strcmp(path,"/pio")==0 && strcmp(method,"PUT")==0) {
-        handle_pio(cfd, body);
-    } else if (strcmp(path,"/status")==0) {
-        send_405(cfd);
-    } else {
-        send_404(cfd);
+// Command journal
+// With JOURNAL_DIR set, every command a bus worker applies, suppresses or
+// fails is appended to a per-board log of memory-mapped segments
+// "<JOURNAL_DIR>/<board>-<seq>.kj", JOURNAL_SEGMENT_MB each; the newest
+// JOURNAL_SEGMENTS are kept. The worker is the only writer, so an append is a
+// copy into the mapping and a release store of the record length, with no
+// lock or syscall. A helper thread maps the next segment ahead of time and
+// trims and unmaps the full one, so rotation is a swap under a lock the helper
+// only holds to hand segments over. Records run up to the first zero length.
+// Status polls are not recorded.
+#define JOURNAL_MAGIC 0x314c4e4a3542434bull     // "KCB5JNL1"
+#define JOURNAL_VERSION 1
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version, seq;
+    char board[32];
+    uint64_t created_ns;        // CLOCK_REALTIME
+    uint8_t pad[8];
+} journal_hdr_t;
+
+typedef struct {
+    _Atomic uint32_t len;       // whole record padded to 8 bytes, stored last
+    uint8_t kind;               // CMD_*
+    int8_t result;              // 1 issued, 0 suppressed, -1 failed
+    uint16_t target;
+    uint64_t t_ns;              // CLOCK_REALTIME when the worker took it
+    int32_t v[2];
+    uint32_t client;
+    uint32_t bus_us;            // time spent issuing it
+    uint8_t data[];             // raw writes, CMD_CONFIG: payload
+} journal_rec_t;
+
+typedef struct {
+    journal_hdr_t *hdr;         // NULL: none
+    size_t off;
+    int fd;
+} jseg_t;
+
+typedef struct journal {
+    char dir[256], board[32];
+    size_t seg_size;
+    int keep;
+    uint32_t next_seq;          // helper only
+    jseg_t cur;                 // worker only
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    jseg_t spare, retired;      // under lock
+    _Atomic uint64_t records, dropped;
+} journal_t;
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int jseg_create(journal_t *j, jseg_t *sg) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/%s-%08u.kj", j->dir, j->board, j->next_seq);
+    sg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sg->fd < 0) return -1;
+    void *m = MAP_FAILED;
+    if (ftruncate(sg->fd, j->seg_size) == 0)
+        m = mmap(NULL, j->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, sg->fd, 0);
+    if (m == MAP_FAILED) { close(sg->fd); unlink(path); return -1; }
+    sg->hdr = m;
+    sg->off = sizeof(journal_hdr_t);
+    *sg->hdr = (journal_hdr_t){.magic = JOURNAL_MAGIC, .version = JOURNAL_VERSION, .seq = j->next_seq,
+                               .created_ns = wall_ns()};
+    snprintf(sg->hdr->board, sizeof(sg->hdr->board), "%s", j->board);
+    if (j->next_seq >= (uint32_t)j->keep) {
+        snprintf(path, sizeof(path), "%s/%s-%08u.kj", j->dir, j->board, j->next_seq - j->keep);
+        unlink(path);
     }
-    close(cfd);
+    j->next_seq++;
+    return 0;
 }
 
-int main() {
-    // --- Configuration from environment ---
-    const char *host = getenv_default("SERVER_HOST", "0.0.0.0");
-    int port = getenv_int("SERVER_PORT", 8080);
-    const char *uart_port = getenv("UART_PORT");
-    int uart_baud = getenv_int("UART_BAUD", B115200);
-    const char *i2c_dev = getenv("I2C_DEV");
-    const char *spi_dev = getenv("SPI_DEV");
-    const char *ics_port = getenv("ICS_PORT");
+// A full segment is cut to the records it holds.
+static void jseg_close(journal_t *j, jseg_t *sg) {
+    msync(sg->hdr, sg->off, MS_ASYNC);
+    munmap(sg->hdr, j->seg_size);
+    if (ftruncate(sg->fd, sg->off) < 0) perror("journal");
+    close(sg->fd);
+    sg->hdr = NULL;
+}
+
+static void *journal_thread(void *arg) {
+    journal_t *j = arg;
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (j->spare.hdr && !j->retired.hdr) pthread_cond_wait(&j->cond, &j->lock);
+        jseg_t old = j->retired;
+        j->retired.hdr = NULL;
+        pthread_mutex_unlock(&j->lock);
+        if (old.hdr) jseg_close(j, &old);
+        jseg_t sg = {0};
+        if (!j->spare.hdr && jseg_create(j, &sg) < 0) { perror(j->dir); sleep_ns(1000000000); }
+        pthread_mutex_lock(&j->lock);
+        if (sg.hdr) j->spare = sg;
+    }
+    return NULL;
+}
 
-    uart_handle_t uart = {.fd=-1}; i2c_handle_t i2c = {.fd=-1};
-    spi_handle_t spi = {.fd=-1}; ics_handle_t ics = {.fd=-1};
+// Segment numbers continue from the highest one already in the directory.
+static journal_t *journal_open(const char *dir, const char *board) {
+    journal_t *j = calloc(1, sizeof(*j));
+    if (!j) return NULL;
+    snprintf(j->dir, sizeof(j->dir), "%s", dir);
+    snprintf(j->board, sizeof(j->board), "%s", board);
+    j->seg_size = (size_t)getenv_int("JOURNAL_SEGMENT_MB", 16) << 20;
+    j->keep = getenv_int("JOURNAL_SEGMENTS", 8);
+    if (j->seg_size < 65536) j->seg_size = 65536;
+    if (j->keep < 2) j->keep = 2;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) { free(j); return NULL; }
+    DIR *d = opendir(dir);
+    size_t blen = strlen(board);
+    for (struct dirent *e; d && (e = readdir(d)); ) {
+        char *end;
+        if (strncmp(e->d_name, board, blen) != 0 || e->d_name[blen] != '-') continue;
+        unsigned long seq = strtoul(e->d_name + blen + 1, &end, 10);
+        if (strcmp(end, ".kj") == 0 && seq + 1 > j->next_seq) j->next_seq = seq + 1;
+    }
+    if (d) closedir(d);
+    pthread_t t;
+    if (jseg_create(j, &j->cur) < 0 || pthread_create(&t, NULL, journal_thread, j) != 0) { free(j); return NULL; }
+    pthread_detach(t);
+    return j;
+}
 
-    if (uart_port) uart_open(&uart, uart_port, uart_baud);
-    if (i2c_dev) i2c_open(&i2c, i2c_dev);
-    if (spi_dev) spi_open(&spi, spi_dev);
-    if (ics_port) ics_open(&ics, ics_port, uart_baud);
+// Worker only. Drops the record if the helper has no segment ready yet.
+static void journal_append(journal_t *j, const bus_cmd_t *c, int result, uint64_t bus_ns) {
+    size_t need = (sizeof(journal_rec_t) + c->len + 7) & ~(size_t)7;
+    if (j->cur.off + need > j->seg_size) {
+        pthread_mutex_lock(&j->lock);
+        int ok = j->spare.hdr && sizeof(journal_hdr_t) + need <= j->seg_size;
+        if (ok) {
+            j->retired = j->cur;
+            j->cur = j->spare;
+            j->spare.hdr = NULL;
+            pthread_cond_signal(&j->cond);
+        }
+        pthread_mutex_unlock(&j->lock);
+        if (!ok) { atomic_fetch_add_explicit(&j->dropped, 1, memory_order_relaxed); return; }
+    }
+    journal_rec_t *r = (journal_rec_t *)((char *)j->cur.hdr + j->cur.off);
+    r->kind = c->kind;
+    r->result = result;
+    r->target = c->target;
+    r->t_ns = wall_ns();
+    r->v[0] = c->v[0]; r->v[1] = c->v[1];
+    r->client = c->client;
+    r->bus_us = bus_ns / 1000;
+    memcpy(r->data, c->data, c->len);
+    atomic_store_explicit(&r->len, need, memory_order_release);
+    j->cur.off += need;
+    atomic_fetch_add_explicit(&j->records, 1, memory_order_relaxed);
+}
 
-    // --- Setup HTTP server ---
-    int sfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sfd < 0) { perror("socket"); exit(1); }
-    int optval = 1;
-    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind"); exit(1);
-    }
-    listen(sfd, 8);
-
-    printf("KCB-5 HTTP driver listening on %s:%d\n", host, port);
-    while (1) {
-        struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
-        int cfd = accept(sfd, (struct sockaddr*)&cli, &clilen);
-        if (cfd < 0) continue;
-        handle_client(cfd, &uart, &i2c, &spi, &ics);
+// Bus loss
+// A device that goes away (USB-serial adapter unplugged or re-enumerated) is
+// noticed by the worker, from an I/O error that means the device is gone or
+// from a hangup on a serial fd (polled every LINK_CHECK_MS). It closes the
+// handle and wakes the link thread to reopen it. Writes for a bus that is
+// down are, with BUS_DOWN=hold, kept up to BUS_HOLD_MS (coalesced like any
+// others) and replayed once it is back, or with BUS_DOWN=fail refused at once:
+// HTTP writes get 503, others count as errors. Batch steps always fail, so
+// the batch rolls back. Emulated buses cannot be lost.
+#define LINK_CHECK_MS 100
+#define HOLD_MAX 1024
+
+static struct {
+    int hold, hold_ms;
+    int retry_max_ms;
+} link_cfg;
+
+static void link_init(void) {
+    link_cfg.hold = strcmp(getenv_default("BUS_DOWN", "hold"), "fail") != 0;
+    link_cfg.hold_ms = getenv_int("BUS_HOLD_MS", 1000);
+    link_cfg.retry_max_ms = getenv_int("BUS_RETRY_MAX_MS", 5000);
+}
+
+// Bus a command goes out on, -1 for none.
+static int cmd_link(int kind) {
+    switch (kind) {
+    case CMD_UART: case CMD_PIO: case CMD_PWM: case CMD_DAC: return BUS_UART;
+    case CMD_I2C:  return BUS_I2C;
+    case CMD_SPI:  return BUS_SPI;
+    case CMD_SERVO: return BUS_ICS;
+    }
+    return -1;
+}
+
+// Configured, but not (or no longer) attached.
+static int link_down(bus_sched_t *s, int kind) {
+    int k = cmd_link(kind);
+    return k >= 0 && s->link[k].path && atomic_load(&s->link[k].state) != LINK_UP;
+}
+
+// Errors after which the handle is useless. I2C answers a missing slave with
+// EIO/ENXIO, so those only count on serial lines.
+static int link_gone(int k, int err) {
+    if (err == ENODEV || err == ESHUTDOWN || err == EBADF) return 1;
+    return (k == BUS_UART || k == BUS_ICS) && (err == EIO || err == ENXIO || err == EPIPE);
+}
+
+static int *link_fd(bus_sched_t *s, int k) {
+    switch (k) {
+    case BUS_UART: return &s->uart->fd;
+    case BUS_I2C:  return &s->i2c->fd;
+    case BUS_SPI:  return &s->spi->fd;
     }
+    return &s->ics->fd;
+}
+
+// Worker only. Whether a failed write cut a serial frame short (and clears that).
+static int link_torn(bus_sched_t *s, int k) {
+    uart_handle_t *h = k == BUS_UART ? s->uart : k == BUS_ICS ? s->ics : NULL;
+    if (!h || !h->torn) return 0;
+    h->torn = 0;
+    return 1;
+}
+
+// Worker only; err 0 for a hangup.
+static void link_lost(bus_sched_t *s, int k, int err) {
+    bus_link_t *l = &s->link[k];
+    if (!l->path || is_emu(l->path) || atomic_load(&l->state) != LINK_UP) return;
+    int *fd = link_fd(s, k);
+    close(*fd);
+    *fd = -1;
+    l->lost_ns = now_ns();
+    atomic_store(&l->err, err);
+    atomic_fetch_add(&l->losses, 1);
+    fprintf(stderr, "board %s: lost %s: %s, reconnecting\n", s->id, l->path, err ? strerror(err) : "hangup");
+    pthread_mutex_lock(&l->lock);
+    atomic_store(&l->state, LINK_DOWN);
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+}
 
-    close(sfd);
-    if (uart.fd>0) close(uart.fd);
-    if (i2c.fd>0) close(i2c.fd);
-    if (spi.fd>0) close(spi.fd);
-    if (ics.fd>0) close(ics.fd);
+// Looks for hangups on the serial lines; TTY drivers flag a vanished device
+// with POLLHUP/POLLERR even without a read pending.
+static void link_check(wtimer_t *t) {
+    bus_sched_t *s = t->arg;
+    for (int k = BUS_UART; k < BUS_KINDS; k += BUS_ICS - BUS_UART) {
+        if (atomic_load(&s->link[k].state) != LINK_UP || is_emu(s->link[k].path)) continue;
+        struct pollfd pfd = {.fd = *link_fd(s, k)};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) link_lost(s, k, 0);
+    }
+    twheel_add(&s->wheel, t, LINK_CHECK_MS);
+}
+
+static void hold_expired(wtimer_t *t) { (void)t; }  // only wakes the worker
+
+static void sched_submit(bus_sched_t *s, bus_cmd_t *c) {
+    TRACE_BEGIN(t0, bus_enqueue);
+    c->t_submit = now_ns();
+    pthread_mutex_lock(&s->lock);
+    if (s->tail) s->tail->next = c; else s->head = c;
+    s->tail = c;
+    s->depth++;
+    int wake = s->sleeping;
+    s->sleeping = 0;
+    pthread_mutex_unlock(&s->lock);
+    uint64_t one = 1;
+    if (wake && write(s->wake, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd");
+    atomic_fetch_add_explicit(&s->submitted, 1, memory_order_relaxed);
+    TRACE_END(t0, bus_enqueue, TR_BUS_ENQUEUE, c->kind);
+}
+
+static shadow_t *sched_shadow(bus_sched_t *s, bus_cmd_t *c) {
+    switch (c->kind) {
+    case CMD_PIO: return &s->pio[c->target];
+    case CMD_PWM: return &s->pwm[c->target];
+    case CMD_DAC: return &s->dac[c->target];
+    }
+    return NULL;
+}
+
+// Latest write per target wins within a batch. Targets are small fixed ranges,
+// so a per-kind table of the last command seen is enough.
+static void sched_coalesce(bus_sched_t *s, bus_cmd_t *list) {
+    bus_cmd_t *last_servo[ICS_IDS] = {0}, *last_pio[PIO_PORTS] = {0};
+    bus_cmd_t *last_pwm[PWM_CHANNELS] = {0}, *last_dac[DAC_CHANNELS] = {0};
+    for (bus_cmd_t *c = list; c; c = c->next) {
+        bus_cmd_t **slot = NULL;
+        switch (c->kind) {
+        case CMD_SERVO: slot = &last_servo[c->target]; break;
+        case CMD_PIO:   slot = &last_pio[c->target]; break;
+        case CMD_PWM:   slot = &last_pwm[c->target]; break;
+        case CMD_DAC:   slot = &last_dac[c->target]; break;
+        default: continue;
+        }
+        if (*slot) {
+            (*slot)->dropped = 1;
+            c->force |= (*slot)->force;
+            atomic_fetch_add_explicit(&s->coalesced, 1, memory_order_relaxed);
+        }
+        *slot = c;
+    }
+}
+
+// Status requests
+// The worker sends a status request and goes on with other work; the reply is
+// collected without blocking, whenever the worker wakes up while one is
+// outstanding, including for the UART turning readable. Input is scanned for
+// a well-formed status reply (STX, reply code, length, checksum), skipping
+// anything else the board sent, such as answers to raw /uart writes. A reply
+// not in within STATUS_TIMEOUT_MS is given up on, so the next period sends a
+// fresh request; if it shows up later it is still taken.
+static void status_publish(bus_sched_t *s, const status_sample_t *smp) {
+    // The version only moves when the board state does, so long-polls wake on change.
+    pthread_mutex_lock(&s->status.lock);
+    int changed = memcmp(&s->status.cur.ad, &smp->ad, sizeof(*smp) - offsetof(status_sample_t, ad)) != 0;
+    s->status.cur = *smp;
+    if (changed) s->status.version++;
+    uint64_t version = s->status.version;
+    pthread_mutex_unlock(&s->status.lock);
+    if (s->shm) shm_publish(s->shm, smp, version);
+    if (s->hist) history_append(s->hist, smp);
+    if (changed) {
+        atomic_store(&s->status_changed, 1);
+        loop_wake();
+    }
+}
+
+static void status_done(bus_sched_t *s) {
+    s->rx_wait = 0;
+    twheel_del(&s->wheel, &s->rx_timer);
+    atomic_store(&s->poll_inflight, 0);
+}
+
+// Worker only. Reads what the UART holds and takes any status replies in it.
+static void status_rx(bus_sched_t *s) {
+    uint8_t *b = s->rx;
+    ssize_t r = 0;
+    while (s->uart->fd > 0 && (r = uart_read(s->uart, b + s->rx_len, sizeof(s->rx) - s->rx_len)) > 0) {
+        s->rx_len += r;
+        for (;;) {
+            size_t i = 0;
+            while (i < s->rx_len && !(b[i] == KCB_STX &&
+                   (i + 1 >= s->rx_len || b[i+1] == (KCB_CMD_STATUS | 0x80)) &&
+                   (i + 2 >= s->rx_len || b[i+2] == KCB_STATUS_LEN))) i++;
+            s->rx_len -= i;
+            memmove(b, b + i, s->rx_len);
+            if (s->rx_len < KCB_STATUS_LEN + 4) break;
+            status_sample_t smp;
+            size_t used = status_parse(b, s->rx_len, &smp) < 0 ? 1 : KCB_STATUS_LEN + 4;
+            s->rx_len -= used;
+            memmove(b, b + used, s->rx_len);
+            if (used == 1) continue;
+            s->rx_replies++;
+            status_publish(s, &smp);
+            if (s->rx_wait) status_done(s);
+        }
+    }
+    if (r < 0 && errno != EAGAIN && errno != EINTR && link_gone(BUS_UART, errno)) link_lost(s, BUS_UART, errno);
+}
+
+static void status_timeout(wtimer_t *t) {
+    bus_sched_t *s = t->arg;
+    status_rx(s);
+    if (!s->rx_wait) return;
+    atomic_fetch_add_explicit(&s->poll_timeouts, 1, memory_order_relaxed);
+    status_done(s);
+}
+
+// Worker only. Sends a status request unless one is already out.
+static int status_request(bus_sched_t *s) {
+    if (s->rx_wait) return 0;
+    uint8_t frame[8];
+    int n = kcb_frame(frame, KCB_CMD_STATUS, NULL, 0);
+    atomic_store(&s->poll_inflight, 1);
+    if (uart_write(s->uart, frame, n) != n) {
+        atomic_store(&s->poll_inflight, 0);
+        if (link_torn(s, BUS_UART) || link_gone(BUS_UART, errno)) link_lost(s, BUS_UART, errno);
+        return -1;
+    }
+    s->rx_wait = 1;
+    twheel_add(&s->wheel, &s->rx_timer, s->cfg.poll_timeout_ms);
+    return 0;
+}
+
+// Applies new bus settings between two transactions.
+static int sched_configure(bus_sched_t *s, const bus_cfg_t *cfg) {
+    int r = 0;
+    if (memcmp(&cfg->uart, &s->cfg.uart, sizeof(cfg->uart)) != 0) {
+        if (s->uart && s->uart->fd > 0 && uart_configure(s->uart, &cfg->uart) < 0) r = -1;
+        if (s->ics && s->ics->fd > 0 && uart_configure(s->ics, &cfg->uart) < 0) r = -1;
+    }
+    if ((cfg->spi_mode != s->cfg.spi_mode || cfg->spi_speed != s->cfg.spi_speed) &&
+        s->spi && s->spi->fd > 0 && spi_configure(s->spi, cfg->spi_mode, cfg->spi_speed) < 0) r = -1;
+    pthread_mutex_lock(&s->cfg_lock);
+    int poll_ms = s->cfg.poll_ms;
+    s->cfg = *cfg;
+    s->cfg.poll_ms = poll_ms;   // the loop thread owns that one
+    pthread_mutex_unlock(&s->cfg_lock);
+    return r;
+}
+
+// The settings as of now, for threads other than the worker (link threads
+// opening a device, the loop reporting them).
+static bus_cfg_t sched_cfg(bus_sched_t *s) {
+    pthread_mutex_lock(&s->cfg_lock);
+    bus_cfg_t cfg = s->cfg;
+    pthread_mutex_unlock(&s->cfg_lock);
+    return cfg;
+}
+
+// Loop thread: poll_ms takes effect without waiting for the worker.
+static void sched_set_poll(bus_sched_t *s, int ms) {
+    pthread_mutex_lock(&s->cfg_lock);
+    __atomic_store_n(&s->cfg.poll_ms, ms, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->cfg_lock);
+}
+
+// Takes over a freshly opened device, brought in line with settings a reload
+// may have changed while it was being opened.
+static int sched_attach(bus_sched_t *s, bus_attach_t *a) {
+    int r = 0;
+    switch (a->link->kind) {
+    case BUS_UART: *s->uart = a->h.uart; r = uart_configure(s->uart, &s->cfg.uart); break;
+    case BUS_ICS:  *s->ics = a->h.uart; r = uart_configure(s->ics, &s->cfg.uart); break;
+    case BUS_I2C:  *s->i2c = a->h.i2c; break;
+    case BUS_SPI:  *s->spi = a->h.spi; r = spi_configure(s->spi, s->cfg.spi_mode, s->cfg.spi_speed); break;
+    }
+    // After a loss the board may have reset: nothing the shadows say can be trusted.
+    if (a->link->kind == BUS_UART) {
+        memset(s->pio, 0, sizeof(s->pio));
+        memset(s->pwm, 0, sizeof(s->pwm));
+        memset(s->dac, 0, sizeof(s->dac));
+    }
+    if (a->link->kind == BUS_ICS) memset(s->servo, 0, sizeof(s->servo));
+    if (a->link->kind == BUS_UART) s->rx_len = 0;
+    if (a->link->lost_ns)
+        fprintf(stderr, "board %s: %s back after %llu ms\n", s->id, a->link->path,
+            (unsigned long long)((now_ns() - a->link->lost_ns) / 1000000));
+    atomic_store(&a->link->state, LINK_UP);
+    s->replay = s->held != NULL;
+    return r;
+}
+
+static int sched_exec(bus_sched_t *s, bus_cmd_t *c) {
+    uint8_t p[4], frame[16];
+    int n = -1;
+    switch (c->kind) {
+    case CMD_UART:
+        if (s->uart && s->uart->fd>0) return uart_write(s->uart, c->data, c->len) != (ssize_t)c->len ? -1 : 0;
+        return 0;
+    case CMD_I2C:
+        if (s->i2c && s->i2c->fd>0) return i2c_write(s->i2c, c->target, c->data, c->len) < 0 ? -1 : 0;
+        return 0;
+    case CMD_SPI:
+        if (s->spi && s->spi->fd>0) return spi_write(s->spi, c->data, c->len) < 0 ? -1 : 0;
+        return 0;
+    case CMD_SERVO:
+        // ICS 3.5 position command
+        if (!s->ics || s->ics->fd<=0) return 0;
+        p[0] = 0x80 | c->target; p[1] = (c->v[0] >> 7) & 0x7f; p[2] = c->v[0] & 0x7f;
+        return ics_write(s->ics, p, 3) != 3 ? -1 : 0;
+    case CMD_STATUS:
+        n = s->uart && s->uart->fd>0 ? status_request(s) : 0;
+        if (!s->rx_wait) atomic_store(&s->poll_inflight, 0);
+        return n;
+    case CMD_CONFIG:
+        return sched_configure(s, (const bus_cfg_t *)c->data);
+    case CMD_ATTACH:
+        return sched_attach(s, (bus_attach_t *)c->data);
+    case CMD_PIO:
+        p[0] = c->target; p[1] = c->v[0];
+        n = kcb_frame(frame, KCB_CMD_PIO, p, 2);
+        break;
+    case CMD_PWM:
+        p[0] = c->target; p[1] = c->v[0]; p[2] = c->v[1] >> 8; p[3] = c->v[1];
+        n = kcb_frame(frame, KCB_CMD_PWM, p, 4);
+        break;
+    case CMD_DAC:
+        p[0] = c->target; p[1] = c->v[0] >> 8; p[2] = c->v[0];
+        n = kcb_frame(frame, KCB_CMD_DAC, p, 3);
+        break;
+    }
+    if (n < 0 || !s->uart || s->uart->fd<=0) return 0;
+    return uart_write(s->uart, frame, n) != n ? -1 : 0;
+}
+
+// Issues one command against its shadow. Returns 1 issued, 0 suppressed, -1 failed.
+static int sched_issue(bus_sched_t *s, bus_cmd_t *c) {
+    shadow_t *sh = sched_shadow(s, c);
+    if (link_down(s, c->kind)) {
+        atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+        return -1;
+    }
+    if (sh && sh->valid && !c->force && sh->v[0] == c->v[0] && sh->v[1] == c->v[1]) {
+        atomic_fetch_add_explicit(&s->suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+    trace_req = c->req;
+    // Servo positions are only kept for rollback; servo writes always go out.
+    if (!sh && c->kind == CMD_SERVO) sh = &s->servo[c->target];
+    if (sched_exec(s, c) < 0) {
+        int k = cmd_link(c->kind);
+        if (k >= 0 && (link_torn(s, k) || link_gone(k, errno))) link_lost(s, k, errno);
+        atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+        if (sh) sh->valid = 0;      // device state unknown, next write must go out
+        return -1;
+    }
+    atomic_fetch_add_explicit(&s->issued, 1, memory_order_relaxed);
+    if (sh) { sh->valid = 1; sh->v[0] = c->v[0]; sh->v[1] = c->v[1]; }
+    return 1;
+}
+
+static int sched_apply(bus_sched_t *s, bus_cmd_t *c) {
+    if (!s->jnl || c->kind == CMD_STATUS || c->kind == CMD_ATTACH) return sched_issue(s, c);
+    uint64_t t0 = now_ns();
+    int r = sched_issue(s, c);
+    journal_append(s->jnl, c, r, now_ns() - t0);
+    return r;
+}
+
+// Watchdogs
+// Dead-man timers on the worker's wheel. With WATCHDOG_MS set, a servo, PWM
+// channel or PIO port that is not written again within it is put into its safe
+// state. Independently, commands carrying a client id (X-Client-Id, a UDP
+// sender) make that client the target's owner; if the client then sends
+// nothing, not even a heartbeat, within its timeout, every target it still
+// owns goes safe. Safe-state writes are forced and issued by the worker right
+// away, ahead of anything still queued. Safe states: servos free (position 0)
+// or, with SAFE_SERVO=hold, left at their last position; PWM duty 0; PIO bits
+// in SAFE_PIO_MASK set to SAFE_PIO_VALUE.
+#define WD_CLIENT_MAX_MS 600000
+
+static struct {
+    int target_ms;              // WATCHDOG_MS, 0: off
+    int client_ms;              // CLIENT_WATCHDOG_MS, default for X-Client-Id
+    int servo_hold;
+    int pio_mask, pio_value;
+} wd_cfg;
+
+typedef struct wd_client {
+    wtimer_t timer;             // first: timer callbacks cast back
+    struct wd_client *next;     // hash chain
+    uint32_t id;
+} wd_client_t;
+
+static void watchdog_init(void) {
+    wd_cfg.target_ms = getenv_int("WATCHDOG_MS", 0);
+    wd_cfg.client_ms = getenv_int("CLIENT_WATCHDOG_MS", 500);
+    wd_cfg.servo_hold = strcmp(getenv_default("SAFE_SERVO", "free"), "hold") == 0;
+    wd_cfg.pio_mask = strtol(getenv_default("SAFE_PIO_MASK", "0xff"), NULL, 0) & 0xff;
+    wd_cfg.pio_value = strtol(getenv_default("SAFE_PIO_VALUE", "0"), NULL, 0) & 0xff;
+}
+
+// Client ids are hashes of a client name or address; 0 is reserved for none.
+static uint32_t client_id(const void *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ ((const uint8_t *)p)[i]) * 16777619u;
+    return h ? h : 1;
+}
+
+static wd_target_t *wd_target(bus_sched_t *s, int kind, int target) {
+    switch (kind) {
+    case CMD_SERVO: return &s->wd_servo[target];
+    case CMD_PWM:   return &s->wd_pwm[target];
+    case CMD_PIO:   return &s->wd_pio[target];
+    }
+    return NULL;
+}
+
+static void wd_safe(bus_sched_t *s, wd_target_t *t) {
+    bus_cmd_t c = {.kind = t->kind, .target = t->target, .force = 1};
+    twheel_del(&s->wheel, &t->timer);
+    t->owner = 0;
+    atomic_fetch_add_explicit(&s->watchdog_trips, 1, memory_order_relaxed);
+    switch (t->kind) {
+    case CMD_SERVO:
+        if (wd_cfg.servo_hold) return;
+        break;
+    case CMD_PWM:
+        c.v[1] = t->period;
+        break;
+    case CMD_PIO: {
+        shadow_t *sh = sched_shadow(s, &c);
+        int cur = sh->valid ? sh->v[0] : 0;
+        c.v[0] = (cur & ~wd_cfg.pio_mask) | (wd_cfg.pio_value & wd_cfg.pio_mask);
+        break;
+    }
+    }
+    sched_apply(s, &c);
+}
+
+static void wd_target_expired(wtimer_t *tm) {
+    wd_safe(tm->arg, (wd_target_t *)tm);
+}
+
+static void wd_client_expired(wtimer_t *tm) {
+    bus_sched_t *s = tm->arg;
+    wd_client_t *cl = (wd_client_t *)tm, **pp = &s->wd_clients[cl->id % WD_CLIENT_BUCKETS];
+    wd_target_t *all[] = {s->wd_servo, s->wd_pwm, s->wd_pio};
+    int n[] = {ICS_IDS, PWM_CHANNELS, PIO_PORTS};
+    for (int k = 0; k < 3; k++)
+        for (int i = 0; i < n[k]; i++)
+            if (all[k][i].owner == cl->id) wd_safe(s, &all[k][i]);
+    while (*pp != cl) pp = &(*pp)->next;
+    *pp = cl->next;
+    free(cl);
+}
+
+static void watchdog_start(bus_sched_t *s) {
+    twheel_init(&s->wheel);
+    wd_target_t *all[] = {s->wd_servo, s->wd_pwm, s->wd_pio};
+    int n[] = {ICS_IDS, PWM_CHANNELS, PIO_PORTS}, kind[] = {CMD_SERVO, CMD_PWM, CMD_PIO};
+    for (int k = 0; k < 3; k++)
+        for (int i = 0; i < n[k]; i++)
+            all[k][i] = (wd_target_t){.timer = {.fn = wd_target_expired, .arg = s}, .kind = kind[k], .target = i};
+}
+
+// Called by the worker for every write it takes, applied or not, and for heartbeats.
+static void watchdog_feed(bus_sched_t *s, bus_cmd_t *c) {
+    wd_target_t *t = wd_target(s, c->kind, c->target);
+    if (t) {
+        if (c->kind == CMD_PWM) t->period = c->v[1];
+        if (wd_cfg.target_ms > 0) twheel_add(&s->wheel, &t->timer, wd_cfg.target_ms);
+        t->owner = c->client;
+    } else if (c->kind != CMD_HEARTBEAT) return;
+    if (!c->client) return;
+    wd_client_t **head = &s->wd_clients[c->client % WD_CLIENT_BUCKETS], *cl = *head;
+    while (cl && cl->id != c->client) cl = cl->next;
+    if (!cl) {
+        if (!t || !(cl = calloc(1, sizeof(*cl)))) return;   // heartbeats do not create clients
+        cl->timer = (wtimer_t){.fn = wd_client_expired, .arg = s};
+        cl->id = c->client;
+        cl->next = *head;
+        *head = cl;
+    }
+    twheel_add(&s->wheel, &cl->timer, c->client_ms);
+}
+
+// Last value written to c's target: its shadow, or a servo's position.
+static shadow_t *sched_last(bus_sched_t *s, bus_cmd_t *c) {
+    return c->kind == CMD_SERVO ? &s->servo[c->target] : sched_shadow(s, c);
+}
+
+static void batch_resume(wtimer_t *t);
+
+// Worker only. Runs b from its next step until a step has to wait out its
+// delay (batch_resume continues it) or the batch is over.
+static void sched_run_batch(bus_sched_t *s, batch_t *b) {
+    int i;
+    for (i = b->next; i < b->n; b->next = ++i) {
+        batch_step_t *st = &b->step[i];
+        if (st->delay_ms && !b->waited) {
+            b->waited = 1;
+            b->timer = (wtimer_t){.fn = batch_resume, .arg = s};
+            twheel_add(&s->wheel, &b->timer, st->delay_ms);
+            return;
+        }
+        b->waited = 0;
+        shadow_t *sh = sched_last(s, st->cmd);
+        if (sh) st->prev = *sh;
+        watchdog_feed(s, st->cmd);
+        uint64_t t0 = now_ns();
+        int r = sched_apply(s, st->cmd);
+        st->bus_us = (now_ns() - t0) / 1000;
+        st->status = r > 0 ? STEP_OK : r == 0 ? STEP_SUPPRESSED : STEP_FAILED;
+        if (r < 0) { b->failed = i; break; }
+    }
+    if (b->failed >= 0) {
+        for (int k = i + 1; k < b->n; k++) b->step[k].status = STEP_SKIPPED;
+        // Undo in reverse so the oldest saved value is written last.
+        for (int k = b->failed - 1; k >= 0; k--) {
+            batch_step_t *st = &b->step[k];
+            if (st->status != STEP_OK || !st->prev.valid || !sched_last(s, st->cmd)) continue;
+            bus_cmd_t undo = *st->cmd;
+            undo.v[0] = st->prev.v[0]; undo.v[1] = st->prev.v[1]; undo.force = 1;
+            if (sched_apply(s, &undo) > 0) st->status = STEP_ROLLED_BACK;
+        }
+    }
+    loop_post(&b->done);
+}
+
+static void batch_resume(wtimer_t *t) {
+    sched_run_batch(t->arg, (batch_t *)((char *)t - offsetof(batch_t, timer)));
+}
+
+// Keeps c for replay if its bus is down and BUS_DOWN=hold; expired writes and
+// those beyond HOLD_MAX fall through to fail.
+static int sched_hold(bus_sched_t *s, bus_cmd_t *c, uint64_t now, uint64_t *due) {
+    uint64_t end = c->t_submit + (uint64_t)link_cfg.hold_ms * 1000000;
+    if (!link_cfg.hold || !link_down(s, c->kind) || now >= end || s->held_n >= HOLD_MAX) return 0;
+    c->next = NULL;
+    *s->held_tail = c;
+    s->held_tail = &c->next;
+    s->held_n++;
+    if (end < *due) *due = end;
+    return 1;
+}
+
+static void seq_exec(bus_sched_t *s, struct seq_run *r);
+static void commit_exec(bus_sched_t *s, struct stage *st);
+
+static void *sched_thread(void *arg) {
+    bus_sched_t *s = arg;
+    uint64_t last = 0;
+    rt_thread_setup(0);
+    while (1) {
+        // Sleep until there is work, the next timer is due or, while a status
+        // reply is awaited, the UART has input.
+        pthread_mutex_lock(&s->lock);
+        int idle = s->sleeping = !s->head && !s->replay;
+        pthread_mutex_unlock(&s->lock);
+        if (idle) {
+            struct pollfd pfd[2] = {{.fd = s->wake, .events = POLLIN},
+                                    {.fd = s->rx_wait ? s->uart->fd : -1, .events = POLLIN}};
+            uint64_t cnt;
+            if (poll(pfd, 2, twheel_next_ms(&s->wheel)) > 0 && (pfd[0].revents & POLLIN) &&
+                read(s->wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) perror("eventfd");
+            if (pfd[1].revents & (POLLHUP | POLLERR | POLLNVAL)) link_lost(s, BUS_UART, 0);
+        }
+        if (s->rx_wait) status_rx(s);
+        pthread_mutex_lock(&s->lock);
+        s->sleeping = 0;
+        int work = s->head != NULL;
+        pthread_mutex_unlock(&s->lock);
+        bus_cmd_t *list = NULL;
+        if (work) {
+            // Hold off to the next tick so bursts from HMIs land in one batch.
+            uint64_t now = now_ns(), next = last + (uint64_t)s->cfg.tick_us * 1000;
+            if (now < next) {
+                sleep_until_ns(next);
+                jitter_record(&s->tick_jitter, now_ns() - next);
+            }
+            pthread_mutex_lock(&s->lock);
+            list = s->head;
+            s->head = s->tail = NULL;
+            s->depth = 0;
+            pthread_mutex_unlock(&s->lock);
+            last = now_ns();
+            atomic_store_explicit(&s->lag_ns, last - list->t_submit, memory_order_relaxed);
+            atomic_fetch_add_explicit(&s->ticks, 1, memory_order_relaxed);
+        }
+
+        // Refreshes first, so a target written in this tick never trips.
+        for (bus_cmd_t *c = list; c; c = c->next)
+            if (c->kind != CMD_BATCH) watchdog_feed(s, c);
+        // Held writes are older than anything new, so they go first.
+        if (s->held) {
+            *s->held_tail = list;
+            list = s->held;
+            s->held = NULL;
+            s->held_tail = &s->held;
+            s->held_n = 0;
+        }
+        s->replay = 0;
+        sched_coalesce(s, list);
+        twheel_run(&s->wheel);
+        uint64_t now = now_ns(), hold_due = UINT64_MAX;
+        while (list) {
+            bus_cmd_t *c = list;
+            list = c->next;
+            if (c->kind == CMD_BATCH) sched_run_batch(s, c->batch);
+            else if (c->kind == CMD_SEQ) seq_exec(s, c->run);
+            else if (c->kind == CMD_COMMIT) commit_exec(s, c->stage);
+            else if (!c->dropped && c->kind != CMD_HEARTBEAT) {
+                if (sched_hold(s, c, now, &hold_due)) continue;
+                sched_apply(s, c);
+            }
+            bus_cmd_free(c);
+        }
+        if (s->held) twheel_add(&s->wheel, &s->hold_timer, (hold_due - now) / 1000000);
+        else twheel_del(&s->wheel, &s->hold_timer);
+    }
+    return NULL;
+}
+
+// Status poller: queues one status read per period, skipping a period while
+// the previous read is still waiting for the bus. The period is re-read every
+// round so a reload takes effect; at 0 the poller idles.
+static void *status_poll_thread(void *arg) {
+    bus_sched_t *s = arg;
+    uint64_t next = now_ns();
+    rt_thread_setup(1);
+    while (1) {
+        int ms = __atomic_load_n(&s->cfg.poll_ms, __ATOMIC_RELAXED);
+        if (ms <= 0) { sleep_ns(100000000); next = now_ns(); continue; }
+        uint64_t period = (uint64_t)ms * 1000000;
+        next += period;
+        sleep_until_ns(next);
+        uint64_t now = now_ns();
+        jitter_record(&s->poll_jitter, now - next);
+        if (now > next + period) next = now;   // overran: skip missed periods
+        if (atomic_exchange(&s->poll_inflight, 1)) continue;
+        bus_cmd_t *c = bus_cmd_new(CMD_STATUS, 0, 0);
+        if (!c) { atomic_store(&s->poll_inflight, 0); continue; }
+        sched_submit(s, c);
+    }
+    return NULL;
+}
+
+static int sched_start(bus_sched_t *s) {
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->cfg_lock, NULL);
+    if ((s->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return -1;
+    watchdog_start(s);
+    s->rx_timer = (wtimer_t){.fn = status_timeout, .arg = s};
+    s->held_tail = &s->held;
+    s->hold_timer = (wtimer_t){.fn = hold_expired, .arg = s};
+    s->link_timer = (wtimer_t){.fn = link_check, .arg = s};
+    for (int k = BUS_UART; k < BUS_KINDS; k += BUS_ICS - BUS_UART)
+        if (s->link[k].path && !is_emu(s->link[k].path)) twheel_add(&s->wheel, &s->link_timer, LINK_CHECK_MS);
+    pthread_mutex_init(&s->status.lock, NULL);
+    s->status.cur = (status_sample_t){.ad = {123, 234, 345, 456}, .dip = 0x5, .led = 0xd, .timer = {1000, 2000}};
+    if (pthread_create(&s->thr, NULL, sched_thread, s) != 0) return -1;
+    if (s->link[BUS_UART].path) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, status_poll_thread, s) != 0) return -1;
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+// Shared-memory channel
+// SHM_NAME opts in to a region per board for same-host clients (layout and
+// client side in kcb5_shm.h). A consumer thread per board drains the command
+// ring into the bus scheduler, so these commands coalesce and suppress like
+// HTTP ones; it sleeps on a futex on the ring head while the ring is empty.
+static bus_cmd_t *shm_cmd(const kcb5_cmd_t *c) {
+    bus_cmd_t *bc = NULL;
+    switch (c->kind) {
+    case KCB5_SHM_SERVO:
+        if (c->target >= ICS_IDS || c->v[0] < 0 || c->v[0] > 0x3fff) return NULL;
+        bc = bus_cmd_new(CMD_SERVO, c->target, 0);
+        break;
+    case KCB5_SHM_PWM:
+        if (c->target >= PWM_CHANNELS || c->v[0] < 0 || c->v[0] > 100 || c->v[1] <= 0 || c->v[1] > 0xffff) return NULL;
+        bc = bus_cmd_new(CMD_PWM, c->target, 0);
+        break;
+    case KCB5_SHM_DAC:
+        if (c->target >= DAC_CHANNELS || c->v[0] < 0 || c->v[0] > 0xffff) return NULL;
+        bc = bus_cmd_new(CMD_DAC, c->target, 0);
+        break;
+    case KCB5_SHM_PIO:
+        if (c->target >= PIO_PORTS || c->v[0] < 0 || c->v[0] > 0xff) return NULL;
+        bc = bus_cmd_new(CMD_PIO, c->target, 0);
+        break;
+    }
+    if (bc) { bc->v[0] = c->v[0]; bc->v[1] = c->v[1]; }
+    return bc;
+}
+
+static void *shm_thread(void *arg) {
+    bus_sched_t *s = arg;
+    kcb5_shm_t *m = s->shm;
+    rt_thread_setup(0);
+    uint32_t tail = atomic_load_explicit(&m->tail, memory_order_relaxed);
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&m->head, memory_order_acquire);
+        if (head == tail) {
+            // Announce the sleep before re-checking, so a client publishing
+            // in between either sees waiting or we see its head.
+            atomic_store(&m->waiting, 1);
+            if (atomic_load(&m->head) == tail)
+                syscall(SYS_futex, &m->head, FUTEX_WAIT, tail, NULL, NULL, 0);
+            atomic_store(&m->waiting, 0);
+            continue;
+        }
+        if (head - tail > KCB5_SHM_RING) tail = head - KCB5_SHM_RING;   // client overran the ring
+        for (; tail != head; tail++) {
+            kcb5_cmd_t c = m->ring[tail & (KCB5_SHM_RING - 1)];
+            bus_cmd_t *bc = shm_cmd(&c);
+            if (bc) sched_submit(s, bc);
+            else atomic_fetch_add_explicit(&m->rejected, 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&m->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+static int shm_start(bus_sched_t *s, const char *name) {
+    mode_t mode = strtol(getenv_default("SHM_MODE", "0660"), NULL, 8);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, mode);
+    if (fd < 0) return -1;
+    if (fchmod(fd, mode) < 0 || ftruncate(fd, sizeof(kcb5_shm_t)) < 0) { close(fd); return -1; }
+    void *p = mmap(NULL, sizeof(kcb5_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    kcb5_shm_t *m = p;
+    memset(m, 0, offsetof(kcb5_shm_t, ring));
+    m->version = KCB5_SHM_VERSION;
+    m->ring_size = KCB5_SHM_RING;
+    pthread_mutex_lock(&s->status.lock);
+    shm_publish(m, &s->status.cur, s->status.version);
+    pthread_mutex_unlock(&s->status.lock);
+    atomic_thread_fence(memory_order_release);
+    m->magic = KCB5_SHM_MAGIC;  // last, clients check it
+    s->shm = m;
+    pthread_t t;
+    if (pthread_create(&t, NULL, shm_thread, s) != 0) return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+// Boards
+// One KCB-5 each, with its own buses and bus worker; all share the HTTP loop.
+// BOARD<n>_ID, _UART_PORT, _UART_BAUD, _I2C_DEV, _SPI_DEV, _SPI_MODE,
+// _SPI_SPEED_HZ, _ICS_PORT and _HISTORY_FILE describe board n = 0, 1, ... up
+// to the first one without any bus. Without them the unprefixed variables describe a single board "0".
+#define MAX_BOARDS 64
+
+typedef struct {
+    char id[32];
+    int env;                    // n of its BOARD<n>_ variables, -1: unprefixed
+    uart_handle_t uart; i2c_handle_t i2c; spi_handle_t spi; ics_handle_t ics;
+    bus_sched_t sched;
+} board_t;
+
+static board_t *boards;
+static int nboards;
+
+static const char *board_env(int n, const char *name) {
+    if (n < 0) return getenv(name);
+    char key[64];
+    snprintf(key, sizeof(key), "BOARD%d_%s", n, name);
+    return getenv(key);
+}
+
+// Settings that may change on reload; _UART_BAUD, _SPI_MODE and _SPI_SPEED_HZ
+// fall back to the unprefixed variables.
+static void board_cfg(int n, bus_cfg_t *c) {
+    const char *v;
+    c->uart.baud = (v = board_env(n, "UART_BAUD")) ? atoi(v) : getenv_int("UART_BAUD", 115200);
+    if (c->uart.baud <= 0) c->uart.baud = 115200;
+    c->uart.vmin = getenv_int("UART_VMIN", 0) & 0xff;
+    c->uart.vtime = getenv_int("UART_VTIME", 0) & 0xff;
+    c->uart.low_latency = getenv_int("UART_LOW_LATENCY", 1) != 0;
+    c->spi_mode = (v = board_env(n, "SPI_MODE")) ? atoi(v) : getenv_int("SPI_MODE", 0);
+    c->spi_speed = (v = board_env(n, "SPI_SPEED_HZ")) ? atoi(v) : getenv_int("SPI_SPEED_HZ", 1000000);
+    c->tick_us = getenv_int("SCHED_TICK_US", 1000);
+    c->poll_ms = getenv_int("STATUS_POLL_MS", 100);
+    c->poll_timeout_ms = getenv_int("STATUS_TIMEOUT_MS", 50);
+}
+
+// Opens the buses of board n (-1: unprefixed variables); returns 0 if it has none.
+static int board_open(board_t *b, int n) {
+    const char *uart = board_env(n, "UART_PORT"), *i2c = board_env(n, "I2C_DEV");
+    const char *spi = board_env(n, "SPI_DEV"), *ics = board_env(n, "ICS_PORT");
+    if (n >= 0 && !uart && !i2c && !spi && !ics) return 0;
+    bus_sched_t *s = &b->sched;
+    board_cfg(n, &s->cfg);
+    b->env = n;
+    const char *id = board_env(n, "ID");
+    if (id) snprintf(b->id, sizeof(b->id), "%s", id);
+    else snprintf(b->id, sizeof(b->id), "%d", n < 0 ? 0 : n);
+    b->uart.fd = b->i2c.fd = b->spi.fd = b->ics.fd = -1;
+    const char *path[BUS_KINDS] = {uart, i2c, spi, ics};
+    for (int k = 0; k < BUS_KINDS; k++)
+        s->link[k] = (bus_link_t){.path = path[k], .kind = k, .sched = s,
+                                  .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+    s->id = b->id;
+    s->uart = &b->uart; s->i2c = &b->i2c; s->spi = &b->spi; s->ics = &b->ics;
+    const char *hist_file = board_env(n, "HISTORY_FILE");
+    if (hist_file && !(s->hist = history_open(hist_file, getenv_int("HISTORY_SAMPLES", 262144))))
+        fprintf(stderr, "history: cannot map %s\n", hist_file);
+    const char *jdir = getenv("JOURNAL_DIR");
+    if (jdir && !(s->jnl = journal_open(jdir, b->id))) perror(jdir);
+    return 1;
+}
+
+// Bus bring-up
+// The listener does not wait for the devices: every configured bus is opened
+// and probed by a thread of its own, so a slow or absent one holds up neither
+// startup nor the other buses. Failed attempts are retried with exponential
+// backoff up to BUS_RETRY_MAX_MS, or at once when the device node appears;
+// /readyz turns 200 once every configured bus is attached. The same thread
+// reopens the bus whenever the worker loses it.
+static int link_open(bus_link_t *l, bus_attach_t *a) {
+    bus_cfg_t cfg = sched_cfg(l->sched);
+    int emu = is_emu(l->path);
+    uint8_t mode;
+    unsigned long funcs;
+    switch (l->kind) {
+    case BUS_UART:
+    case BUS_ICS:
+        // uart_setup already checked that the line takes termios settings
+        return (l->kind == BUS_UART ? uart_open : ics_open)(&a->h.uart, l->path, &cfg.uart) < 0 ? -1 : 0;
+    case BUS_I2C:
+        if (i2c_open(&a->h.i2c, l->path) < 0) return -1;
+        if (!emu && ioctl(a->h.i2c.fd, I2C_FUNCS, &funcs) < 0) { close(a->h.i2c.fd); return -1; }
+        return 0;
+    case BUS_SPI:
+        if (spi_open(&a->h.spi, l->path, cfg.spi_mode, cfg.spi_speed) < 0) return -1;
+        if (!emu && ioctl(a->h.spi.fd, SPI_IOC_RD_MODE, &mode) < 0) { close(a->h.spi.fd); return -1; }
+        return 0;
+    }
+    return -1;
+}
+
+// Waits up to ms for the device node to show up. udev creates the node (or a
+// by-id link) and then sets its permissions, so either event triggers a retry.
+static void link_wait(int ino, const char *name, int ms) {
+    if (ino < 0) { sleep_ns((uint64_t)ms * 1000000); return; }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint64_t end = now_ns() + (uint64_t)ms * 1000000, now;
+    struct pollfd pfd = {.fd = ino, .events = POLLIN};
+    while ((now = now_ns()) < end && poll(&pfd, 1, (int)((end - now + 999999) / 1000000)) > 0) {
+        ssize_t n = read(ino, buf, sizeof(buf));
+        for (char *p = buf; n > 0 && p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, name) == 0) return;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+// Opens the bus, hands it to the worker and sleeps until the worker reports
+// it lost, over and over. Retries start at 50 ms and double.
+static void *link_thread(void *arg) {
+    bus_link_t *l = arg;
+    char dir[PATH_MAX], buf[4096];
+    const char *name = path_split(l->path, dir, sizeof(dir));
+    int ino = is_emu(l->path) ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ino >= 0 && inotify_add_watch(ino, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) { close(ino); ino = -1; }
+    for (;;) {
+        bus_cmd_t *c = bus_cmd_new(CMD_ATTACH, l->kind, sizeof(bus_attach_t));
+        if (!c) { perror(l->path); return NULL; }
+        bus_attach_t *a = (bus_attach_t *)c->data;
+        for (int backoff = 50, tries = 0; ; tries++) {
+            *a = (bus_attach_t){.link = l, .h.uart.fd = -1};
+            if (link_open(l, a) == 0) break;
+            int err = errno, max = link_cfg.retry_max_ms;
+            atomic_store(&l->err, err);
+            atomic_fetch_add(&l->failures, 1);
+            if (!tries) fprintf(stderr, "board %s: cannot open %s: %s, retrying\n", l->sched->id, l->path, strerror(err));
+            link_wait(ino, name, backoff);
+            backoff = backoff * 2 < max ? backoff * 2 : max;
+        }
+        // Still down to the worker until it takes the handle; the wait below
+        // must only end on the next loss.
+        atomic_store(&l->state, LINK_OPENING);
+        sched_submit(l->sched, c);
+        pthread_mutex_lock(&l->lock);
+        while (atomic_load(&l->state) != LINK_DOWN) pthread_cond_wait(&l->cond, &l->lock);
+        pthread_mutex_unlock(&l->lock);
+        while (ino >= 0 && read(ino, buf, sizeof(buf)) > 0);   // events from before the loss
+    }
+}
+
+static int boards_open(void) {
+    boards = calloc(MAX_BOARDS, sizeof(board_t));
+    if (!boards) return -1;
+    while (nboards < MAX_BOARDS && board_open(&boards[nboards], nboards)) nboards++;
+    if (nboards == 0) board_open(&boards[nboards++], -1);
+    const char *shm = getenv("SHM_NAME");
+    for (int i = 0; i < nboards; i++) {
+        if (sched_start(&boards[i].sched) != 0) return -1;
+        for (int k = 0; k < BUS_KINDS; k++) {
+            bus_link_t *l = &boards[i].sched.link[k];
+            pthread_t t;
+            if (!l->path) continue;
+            atomic_store(&l->state, LINK_OPENING);
+            if (pthread_create(&t, NULL, link_thread, l) != 0) return -1;
+            pthread_detach(t);
+        }
+        if (!shm) continue;
+        char name[128];
+        if (nboards > 1) snprintf(name, sizeof(name), "%s-%s", shm, boards[i].id);
+        else snprintf(name, sizeof(name), "%s", shm);
+        if (shm_start(&boards[i].sched, name) != 0) perror(name);
+    }
+    return 0;
+}
+
+static bus_sched_t *board_find(const char *id, size_t len) {
+    for (int i = 0; i < nboards; i++)
+        if (strlen(boards[i].id) == len && strncmp(boards[i].id, id, len) == 0) return &boards[i].sched;
+    return NULL;
+}
+
+// Journal replay
+// REPLAY=<segment>[,<segment>...] re-issues the journalled commands that were
+// issued (result 1), in order, on the board named in each segment header (or
+// the first board), then exits. Their original spacing is divided by
+// REPLAY_SPEED (default 1; 0: back to back). Each command waits for the
+// worker to take the previous one, so none coalesce that did not originally,
+// and goes past the shadows. With JOURNAL_DIR set the run is journalled too,
+// for comparing results.
+static int replay_valid(const journal_rec_t *r) {
+    switch (r->kind) {
+    case CMD_UART: case CMD_I2C: case CMD_SPI: return 1;
+    case CMD_SERVO: return r->target < ICS_IDS;
+    case CMD_PIO:   return r->target < PIO_PORTS;
+    case CMD_PWM:   return r->target < PWM_CHANNELS;
+    case CMD_DAC:   return r->target < DAC_CHANNELS;
+    case CMD_CONFIG: return r->len >= sizeof(*r) + sizeof(bus_cfg_t);
+    }
+    return 0;
+}
+
+static int replay_run(const char *list) {
+    double speed = strtod(getenv_default("REPLAY_SPEED", "1"), NULL);
+    uint64_t t0 = now_ns(), first = 0, n = 0, skipped = 0, errors = 0;
+    // The buses come up in the background; give them a moment.
+    for (int i = 0; i < nboards; i++)
+        for (int k = 0; k < BUS_KINDS; k++)
+            while (atomic_load(&boards[i].sched.link[k].state) == LINK_OPENING && now_ns() - t0 < 10000000000ull)
+                sleep_ns(10000000);
+    for (int i = 0; i < nboards; i++) errors -= atomic_load(&boards[i].sched.errors);
+    t0 = now_ns();
+    char path[PATH_MAX];
+    for (const char *p = list; *p; p += *p == ',') {
+        size_t len = strcspn(p, ",");
+        snprintf(path, sizeof(path), "%.*s", (int)len, p);
+        p += len;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        void *m = fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(journal_hdr_t) ? MAP_FAILED :
+            mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) close(fd);
+        journal_hdr_t *h = m;
+        if (m == MAP_FAILED || h->magic != JOURNAL_MAGIC || h->version != JOURNAL_VERSION) {
+            fprintf(stderr, "replay: %s is not a journal segment\n", path);
+            if (m != MAP_FAILED) munmap(m, st.st_size);
+            return 1;
+        }
+        bus_sched_t *s = board_find(h->board, strnlen(h->board, sizeof(h->board)));
+        if (!s) s = &boards[0].sched;
+        for (size_t off = sizeof(*h); off + sizeof(journal_rec_t) <= (size_t)st.st_size; ) {
+            const journal_rec_t *r = (const journal_rec_t *)((char *)m + off);
+            uint32_t rlen = atomic_load_explicit(&r->len, memory_order_acquire);
+            if (rlen < sizeof(*r) || off + rlen > (size_t)st.st_size) break;
+            off += rlen;
+            if (r->result != 1 || !replay_valid(r)) { skipped++; continue; }
+            if (!first) first = r->t_ns;
+            if (speed > 0 && r->t_ns > first) sleep_until_ns(t0 + (uint64_t)((r->t_ns - first) / speed));
+            size_t dlen = rlen - sizeof(*r);
+            if (r->kind == CMD_CONFIG) dlen = sizeof(bus_cfg_t);
+            else if (r->kind > CMD_SPI) dlen = 0;
+            bus_cmd_t *c = bus_cmd_new(r->kind, r->target, dlen);
+            if (!c) { perror("replay"); return 1; }
+            memcpy(c->data, r->data, dlen);
+            c->v[0] = r->v[0]; c->v[1] = r->v[1];
+            c->force = 1;
+            if (c->kind == CMD_CONFIG) sched_set_poll(s, ((bus_cfg_t *)c->data)->poll_ms);
+            sched_submit(s, c);
+            n++;
+            for (int busy = 1; busy; ) {
+                pthread_mutex_lock(&s->lock);
+                busy = s->head != NULL;
+                pthread_mutex_unlock(&s->lock);
+                if (busy) sleep_ns(50000);
+            }
+        }
+        munmap(m, st.st_size);
+    }
+    // Let the last command reach the bus.
+    sleep_ns(50000000);
+    for (int i = 0; i < nboards; i++) errors += atomic_load(&boards[i].sched.errors);
+    printf("replay: %llu commands in %.3f s, %llu records skipped, %llu bus errors\n", (unsigned long long)n,
+        (now_ns() - t0) / 1e9, (unsigned long long)skipped, (unsigned long long)errors);
+    return errors ? 2 : 0;
+}
+
+// Growable byte buffer
+// One may start out in a preallocated buffer (fixed); it only moves to the
+// heap if it outgrows that, and sb_rewind brings it back (and frees it).
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    char *fixed;
+    size_t fixed_cap;
+} strbuf_t;
+
+static int sb_reserve(strbuf_t *b, size_t n) {
+    if (b->cap - b->len > n) return 0;
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while (cap - b->len <= n) cap *= 2;
+    int moving = b->buf && b->buf == b->fixed;
+    char *g = realloc(moving ? NULL : b->buf, cap);
+    if (!g) return -1;
+    if (moving) memcpy(g, b->buf, b->len);
+    b->buf = g; b->cap = cap;
+    return 0;
+}
+static void sb_rewind(strbuf_t *b) {
+    b->len = 0;
+    if (b->buf == b->fixed) return;
+    free(b->buf);
+    b->buf = b->fixed;
+    b->cap = b->fixed_cap;
+}
+static int sb_append(strbuf_t *b, const void *p, size_t n) {
+    if (sb_reserve(b, n) < 0) return -1;
+    memcpy(b->buf + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+static int sb_printf(strbuf_t *b, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        size_t room = b->cap - b->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->buf ? b->buf + b->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return -1;
+        if ((size_t)n < room) { b->len += n; return 0; }
+        if (sb_reserve(b, n) < 0) return -1;
+    }
+}
+
+// Memory pools
+// Fixed-size blocks carved from one region mapped at startup: connection
+// objects, their output buffers and request arenas come from here. Plain
+// requests and the JSON listings are built in these and do not touch the heap;
+// what outlives the request or outgrows them still comes from malloc: batches,
+// sequence runs, staging areas, history export and trace dump streams, and any
+// response larger than the output buffer or the arena.
+// Pages are only committed when first used (all at once under RT's mlockall).
+// Loop thread only.
+typedef struct {
+    size_t size;
+    void *free;
+} slab_t;
+
+static int slab_init(slab_t *sl, size_t size, size_t count) {
+    sl->size = (size + 63) & ~(size_t)63;
+    char *p = mmap(NULL, sl->size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    for (size_t i = count; i-- > 0; ) {
+        *(void **)(p + i * sl->size) = sl->free;
+        sl->free = p + i * sl->size;
+    }
+    return 0;
+}
+static void *slab_get(slab_t *sl) {
+    void *p = sl->free;
+    if (p) sl->free = *(void **)p;
+    return p;
+}
+static void slab_put(slab_t *sl, void *p) {
+    *(void **)p = sl->free;
+    sl->free = p;
+}
+
+// Bump allocator for a request's scratch space, rewound before the next one.
+typedef struct {
+    char *base;
+    size_t cap, used;
+} arena_t;
+
+static void *arena_alloc(arena_t *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (a->cap - a->used < n) return NULL;
+    void *p = a->base + a->used;
+    a->used += n;
+    return p;
+}
+
+// HTTP connections
+// One epoll loop owns every client socket. Requests are read into the
+// connection's input buffer until the headers and Content-Length body are in,
+// handlers append the response to its output buffer and the loop flushes it.
+// Instead of answering, a handler may park the connection (long-poll) or hand
+// it to the bus worker (batch); the reply is then written from a loop callback.
+// Event streams (SSE) never finish; the loop just keeps appending to them.
+// Every timeout in the loop is a timer on one wheel behind one timerfd.
+enum { CONN_READING, CONN_WRITING, CONN_PARKED, CONN_BUSY, CONN_STREAM };
+
+typedef struct conn {
+    int fd, state, keepalive, dead;
+    uint32_t events;            // currently registered with epoll
+    uint32_t req;               // trace request id
+    size_t in_len;
+    char in[MAX_REQ_SIZE];
+    strbuf_t out;               // starts in a pooled buffer
+    size_t out_off;
+    arena_t arena;              // scratch for the request being served
+    // Streamed bodies: produce() refills out once it drains, returns 0 when done.
+    int (*produce)(struct conn *);
+    void (*produce_free)(struct conn *);
+    void *ctx;
+    uint32_t client;            // X-Client-Id of the current request, 0: none
+    int client_ms;              // and its watchdog timeout
+    struct source *src;         // TCP peer, for the per-address cap
+    wtimer_t timer;             // read, idle, write or long-poll timeout
+    // long-poll
+    bus_sched_t *board;
+    uint64_t since;
+    struct conn *prev, *next;   // parked or stream list
+} conn_t;
+
+static struct {
+    int ep, wake, listen, unix_listen;
+    pthread_mutex_t lock;
+    post_t *posts;              // callbacks queued by other threads
+    conn_t *parked, *streams;
+    int timer;                  // timerfd for the wheel
+    uint64_t timer_at;          // tick it is armed for, UINT64_MAX: disarmed
+    twheel_t wheel;
+    int read_ms, idle_ms, write_ms;
+    slab_t conn_pool, out_pool, arena_pool;
+} loop = {.ep = -1, .wake = -1, .listen = -1, .unix_listen = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+          .timer = -1, .timer_at = UINT64_MAX};
+
+static void loop_wake(void) {
+    uint64_t one = 1;
+    if (write(loop.wake, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd");
+}
+static void loop_post(post_t *p) {
+    pthread_mutex_lock(&loop.lock);
+    p->next = loop.posts;
+    loop.posts = p;
+    pthread_mutex_unlock(&loop.lock);
+    loop_wake();
+}
+static void conn_link(conn_t **head, conn_t *conn) {
+    conn->prev = NULL;
+    conn->next = *head;
+    if (*head) (*head)->prev = conn;
+    *head = conn;
+}
+static void conn_unlink(conn_t **head, conn_t *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else *head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+}
+// Handlers use these to hold a connection back and answer it later (event loop section).
+static void conn_watch(conn_t *conn, uint32_t events);
+static void conn_park(conn_t *conn, int timeout_ms);
+static void conn_timeout(conn_t *conn, int ms);
+static void conn_resume(conn_t *conn);
+static void conn_stream(conn_t *conn);
+static void conn_stream_flush(conn_t *conn);
+
+// HTTP utility
+// A response body built in the rest of the request arena; sb_rewind releases
+// it if it had to move to the heap.
+static strbuf_t sb_scratch(conn_t *conn) {
+    size_t n = (conn->arena.cap - conn->arena.used) & ~(size_t)15;
+    char *p = n ? arena_alloc(&conn->arena, n) : NULL;
+    return (strbuf_t){.buf = p, .cap = p ? n : 0, .fixed = p, .fixed_cap = p ? n : 0};
+}
+static void send_head(conn_t *conn, const char *status, const char *ctype, size_t len) {
+    sb_printf(&conn->out,
+        "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nAccess-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n",
+        status, ctype, len, conn->keepalive ? "keep-alive" : "close");
+}
+static void send_response_buf(conn_t *conn, const char *status, const char *ctype, const char *body, size_t len) {
+    send_head(conn, status, ctype, len);
+    if (sb_append(&conn->out, body, len) < 0) conn->dead = 1;
+}
+static void send_response(conn_t *conn, const char *status, const char *ctype, const char *body) {
+    send_response_buf(conn, status, ctype, body, strlen(body));
+}
+static void send_json(conn_t *conn, const char *body) {
+    send_response(conn, "200 OK", "application/json", body);
+}
+static void send_204(conn_t *conn) {
+    send_response(conn, "204 No Content", "text/plain", "");
+}
+static void send_400(conn_t *conn, const char *msg) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"error\":\"%s\"}", msg);
+    send_response(conn, "400 Bad Request", "application/json", buf);
+}
+static void send_404(conn_t *conn) {
+    send_response(conn, "404 Not Found", "application/json", "{\"error\":\"Not found\"}");
+}
+static void send_405(conn_t *conn) {
+    send_response(conn, "405 Method Not Allowed", "application/json", "{\"error\":\"Method not allowed\"}");
+}
+static void send_413(conn_t *conn) {
+    conn->keepalive = 0;
+    send_response(conn, "413 Payload Too Large", "application/json", "{\"error\":\"Request too large\"}");
+}
+static void send_retry(conn_t *conn, const char *status, int retry_s) {
+    static const char body[] = "{\"error\":\"Overloaded, retry later\"}";
+    sb_printf(&conn->out,
+        "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nRetry-After: %d\r\n"
+        "Access-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n%s",
+        status, sizeof(body) - 1, retry_s, conn->keepalive ? "keep-alive" : "close", body);
+}
+static const char err_nomem[] = "Out of memory";
+static void send_503(conn_t *conn, const char *msg) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"error\":\"%s\"}", msg);
+    send_response(conn, "503 Service Unavailable", "application/json", buf);
+}
+
+// HTTP parsing
+// Returns the body, which stays in the request buffer.
+static const char *parse_http_request(const char *req, char *method, char *path) {
+    if (sscanf(req, "%7s %255s", method, path) != 2) method[0] = path[0] = 0;
+    const char *b = strstr(req, "\r\n\r\n");
+    return b ? b + 4 : "";
+}
+
+// Minimal JSON field lookup for flat request objects: finds "key": and parses
+// the value that follows. Returns 0 if the key is missing or not a number/bool.
+static const char *json_field(const char *body, const char *key) {
+    char pat[48];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    // A string value can look like a key ("op":"bus"), so keep looking for one followed by ':'.
+    for (const char *p = strstr(body, pat); p; p = strstr(p, pat)) {
+        p += strlen(pat);
+        while (*p == ' ') p++;
+        if (*p != ':') continue;
+        p++;
+        while (*p == ' ') p++;
+        return p;
+    }
+    return NULL;
+}
+static int json_int(const char *body, const char *key, int *out) {
+    const char *p = json_field(body, key);
+    char *end;
+    if (!p) return 0;
+    errno = 0;
+    long v = strtol(p, &end, 10);
+    if (end == p || errno == ERANGE || v < INT_MIN || v > INT_MAX) return 0;   // never wrapped into range
+    *out = (int)v;
+    return 1;
+}
+static int json_str(const char *body, const char *key, char *out, size_t len) {
+    const char *p = json_field(body, key);
+    if (!p || *p++ != '"') return 0;
+    size_t n = strcspn(p, "\"");
+    if (p[n] != '"' || n >= len) return 0;
+    memcpy(out, p, n); out[n] = 0;
+    return 1;
+}
+// Parses "key":[1,2,...] into out; returns the element count, -1 if missing
+// or malformed, -2 if it holds more than max.
+static int json_int_array(const char *body, const char *key, int *out, int max) {
+    const char *p = json_field(body, key);
+    int n = 0;
+    char *end;
+    if (!p || *p++ != '[') return -1;
+    while (*p == ' ') p++;
+    if (*p == ']') return 0;
+    for (;;) {
+        long x = strtol(p, &end, 10);
+        if (end == p) return -1;
+        if (n == max) return -2;
+        out[n++] = x < INT_MIN ? INT_MIN : x > INT_MAX ? INT_MAX : x;  // saturated, so range checks still see it
+        p = end;
+        while (*p == ' ') p++;
+        if (*p == ']') return n;
+        if (*p++ != ',') return -1;
+    }
+}
+// A "data" array of bytes; returns the count, or -1 with *err set.
+static int json_bytes(const char *body, int *out, int max, const char **err) {
+    int n = json_int_array(body, "data", out, max);
+    if (n == -1) { *err = "Missing data"; return -1; }
+    if (n == -2) { *err = "Too much data"; return -1; }
+    for (int i = 0; i < n; i++)
+        if (out[i] < 0 || out[i] > 0xff) { *err = "Data bytes must be 0..255"; return -1; }
+    return n;
+}
+// Copies the next {...} element of an array into out. Returns the position after
+// it, or NULL at the end of the array with *len 0 (malformed or too long: (size_t)-1).
+static const char *json_next_object(const char *p, char *out, size_t cap, size_t *len) {
+    while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') p++;
+    *len = 0;
+    if (*p != '{') { if (*p != ']') *len = (size_t)-1; return NULL; }
+    int depth = 0, in_str = 0;
+    const char *q = p;
+    for (; *q; q++) {
+        if (in_str) { if (*q == '\\' && q[1]) q++; else if (*q == '"') in_str = 0; continue; }
+        if (*q == '"') in_str = 1;
+        else if (*q == '{') depth++;
+        else if (*q == '}' && --depth == 0) break;
+    }
+    if (!*q || (size_t)(q - p + 1) >= cap) { *len = (size_t)-1; return NULL; }
+    *len = q - p + 1;
+    memcpy(out, p, *len); out[*len] = 0;
+    return q + 1;
+}
+static int json_bool(const char *body, const char *key, int *out) {
+    const char *p = json_field(body, key);
+    if (!p) return 0;
+    if (strncmp(p, "true", 4) == 0 || *p == '1') *out = 1;
+    else if (strncmp(p, "false", 5) == 0 || *p == '0') *out = 0;
+    else return 0;
+    return 1;
+}
+
+// Main endpoint logic
+
+// Reads name=<int> from a query string; negative times are taken relative to now.
+static int query_int64(const char *q, const char *name, int64_t *out) {
+    size_t n = strlen(name);
+    for (const char *p = q; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, name, n) == 0 && p[n] == '=') {
+            char *end;
+            long long v = strtoll(p + n + 1, &end, 10);
+            if (end == p + n + 1) return 0;
+            *out = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// /status - GET
+// ?since=<version> long-polls: while the board is still at that version the
+// request is parked in the event loop until the status changes or timeout=<ms>
+// (default 30 s) runs out; either way it is answered with the current snapshot.
+#define LONGPOLL_DEFAULT_MS 30000
+#define LONGPOLL_MAX_MS 300000
+
+static void status_reply(conn_t *conn, bus_sched_t *s) {
+    // Latest snapshot from the status poller (demo values until the board answers)
+    pthread_mutex_lock(&s->status.lock);
+    status_sample_t c = s->status.cur;
+    uint64_t version = s->status.version;
+    pthread_mutex_unlock(&s->status.lock);
+    char json[288];
+    snprintf(json, sizeof(json),
+        "{\"version\":%llu,\"ad\":[%u,%u,%u,%u],\"dip\":[%d,%d,%d,%d],\"led\":[%d,%d,%d,%d],\"timer\":[%u,%u]}",
+        (unsigned long long)version, c.ad[0], c.ad[1], c.ad[2], c.ad[3],
+        c.dip & 1, c.dip >> 1 & 1, c.dip >> 2 & 1, c.dip >> 3 & 1,
+        c.led & 1, c.led >> 1 & 1, c.led >> 2 & 1, c.led >> 3 & 1,
+        c.timer[0], c.timer[1]);
+    send_json(conn, json);
+}
+
+static void handle_status(conn_t *conn, const char *query, bus_sched_t *s) {
+    int64_t since, timeout = LONGPOLL_DEFAULT_MS;
+    if (query_int64(query, "since", &since)) {
+        query_int64(query, "timeout", &timeout);
+        if (since < 0 || timeout < 0 || timeout > LONGPOLL_MAX_MS) { send_400(conn, "Invalid since or timeout"); return; }
+        pthread_mutex_lock(&s->status.lock);
+        uint64_t version = s->status.version;
+        pthread_mutex_unlock(&s->status.lock);
+        if ((uint64_t)since == version && timeout > 0) {
+            conn->board = s;
+            conn->since = since;
+            conn_park(conn, timeout);
+            return;
+        }
+    }
+    status_reply(conn, s);
+}
+
+static int history_bucket(strbuf_t *b, int comma, int64_t t, int64_t count,
+                          const int64_t *mn, const int64_t *mx, const int64_t *sum) {
+    int err = sb_printf(b, "%s{\"t\":%lld,\"n\":%lld", comma ? "," : "", (long long)t, (long long)count);
+    err |= sb_printf(b, ",\"min\":[");
+    for (int c = 0; c < STATUS_CHANNELS; c++) err |= sb_printf(b, "%s%lld", c ? "," : "", (long long)mn[c]);
+    err |= sb_printf(b, "],\"max\":[");
+    for (int c = 0; c < STATUS_CHANNELS; c++) err |= sb_printf(b, "%s%lld", c ? "," : "", (long long)mx[c]);
+    err |= sb_printf(b, "],\"avg\":[");
+    for (int c = 0; c < STATUS_CHANNELS; c++) err |= sb_printf(b, "%s%.3f", c ? "," : "", (double)sum[c] / count);
+    return err | sb_printf(b, "]}");
+}
+
+// /status/history - GET ?from=&to=&step= (ms since epoch, negative: relative to now)
+// step=0 returns raw samples, otherwise min/max/avg per channel per step bucket.
+static void handle_history(conn_t *conn, const char *query, bus_sched_t *s) {
+    history_t *h = s->hist;
+    if (!h) { send_404(conn); return; }
+    int64_t now = wall_ms(), from = -3600000, to = 0, step = 0;
+    query_int64(query, "from", &from);
+    query_int64(query, "to", &to);
+    query_int64(query, "step", &step);
+    if (from <= 0) from += now;
+    if (to <= 0) to += now;
+    if (step < 0 || to < from) { send_400(conn, "Invalid from, to or step"); return; }
+    if (step > 0 && (to - from) / step >= HISTORY_MAX_POINTS) { send_400(conn, "Too many points, increase step"); return; }
+
+    strbuf_t b = sb_scratch(conn);
+    int err = sb_printf(&b, "{\"from\":%lld,\"to\":%lld,\"step\":%lld,\"channels\":[",
+        (long long)from, (long long)to, (long long)step);
+    for (int c = 0; c < STATUS_CHANNELS; c++)
+        err |= sb_printf(&b, "%s\"%s\"", c ? "," : "", status_channel_names[c]);
+    err |= sb_printf(&b, "],\"points\":[");
+
+    int64_t mn[STATUS_CHANNELS], mx[STATUS_CHANNELS], sum[STATUS_CHANNELS];
+    int64_t bucket = -1, count = 0, points = 0;
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+    status_sample_t smp;
+    for (uint64_t i = history_seek(h, from); i < head && !err; i++) {
+        if (!history_get(h, i, &smp)) continue;
+        if ((int64_t)smp.ts_ms > to) break;
+        if (step == 0) {
+            if (points++ == HISTORY_MAX_POINTS) break;
+            err |= sb_printf(&b, "%s{\"t\":%llu,\"v\":[", points > 1 ? "," : "", (unsigned long long)smp.ts_ms);
+            for (int c = 0; c < STATUS_CHANNELS; c++)
+                err |= sb_printf(&b, "%s%lld", c ? "," : "", (long long)status_channel(&smp, c));
+            err |= sb_printf(&b, "]}");
+            continue;
+        }
+        int64_t bk = ((int64_t)smp.ts_ms - from) / step;
+        if (bk != bucket && count > 0) {
+            err |= history_bucket(&b, points++ > 0, from + bucket * step, count, mn, mx, sum);
+            count = 0;
+        }
+        bucket = bk;
+        for (int c = 0; c < STATUS_CHANNELS; c++) {
+            int64_t v = status_channel(&smp, c);
+            if (count == 0) { mn[c] = mx[c] = sum[c] = v; continue; }
+            if (v < mn[c]) mn[c] = v;
+            if (v > mx[c]) mx[c] = v;
+            sum[c] += v;
+        }
+        count++;
+    }
+    if (step > 0 && count > 0 && !err)
+        err |= history_bucket(&b, points > 0, from + bucket * step, count, mn, mx, sum);
+    err |= sb_printf(&b, "]}");
+    if (err) send_503(conn, "Out of memory");
+    else send_response_buf(conn, "200 OK", "application/json", b.buf, b.len);
+    sb_rewind(&b);
+}
+
+// /rom - PUT
+static void handle_rom(conn_t *conn, const char *body) {
+    // Expects {"cmd":"write"/"erase","data":"..."}
+    // Send write/erase command to ROM over UART/I2C/SPI
+    // For demo: just succeed
+    send_204(conn);
+}
+
+// /status/history/export - GET ?from=&to=
+// Columnar binary export for bulk downloads, streamed with chunked encoding and
+// gzip'd when the client sends Accept-Encoding: gzip. Layout (little endian):
+//   "KCB5HX" 0x01 0x00, u8 ncols, ncols NUL-terminated column names ("t", ...)
+//   blocks of up to EXPORT_BLOCK samples: u32 n, then per column the first
+//   value as i64, u8 width and the n-1 zigzag(delta to previous sample) values
+//   bit-packed LSB first in width bits each; u32 0 terminates the stream.
+#define EXPORT_BLOCK 1024
+#define EXPORT_COLS (STATUS_CHANNELS + 1)
+
+static void send_chunk(conn_t *conn, const void *buf, size_t len) {
+    if (len == 0) return;
+    if (sb_printf(&conn->out, "%zx\r\n", len) < 0 || sb_append(&conn->out, buf, len) < 0 ||
+        sb_append(&conn->out, "\r\n", 2) < 0)
+        conn->dead = 1;
+}
+
+// Produced one block at a time as the socket drains, so a long range never
+// holds the event loop or buffers more than a block of output.
+typedef struct {
+    history_t *h;
+    uint64_t next, end;
+    int64_t to;
+    int gzip, done;
+    conn_t *conn;
+    z_stream z;
+    uint8_t out[16384];
+    status_sample_t blk[EXPORT_BLOCK];
+} export_stream_t;
+
+// Feeds encoded bytes to the client, through deflate when gzip was negotiated.
+static void export_write(export_stream_t *x, const void *buf, size_t len, int finish) {
+    if (!x->gzip) { send_chunk(x->conn, buf, len); return; }
+    x->z.next_in = (Bytef*)buf;
+    x->z.avail_in = len;
+    do {
+        x->z.next_out = x->out;
+        x->z.avail_out = sizeof(x->out);
+        if (deflate(&x->z, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) { x->conn->dead = 1; return; }
+        send_chunk(x->conn, x->out, sizeof(x->out) - x->z.avail_out);
+    } while (x->z.avail_out == 0 || (finish && x->z.avail_in > 0));
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// Packs n values of width bits into out, returns bytes used.
+static size_t bitpack(uint8_t *out, const uint64_t *v, int n, int width) {
+    size_t bytes = ((size_t)n * width + 7) / 8;
+    memset(out, 0, bytes);
+    size_t bit = 0;
+    for (int i = 0; i < n; i++, bit += width)
+        for (int k = 0; k < width; k++)
+            if (v[i] >> k & 1) out[(bit + k) / 8] |= 1 << ((bit + k) % 8);
+    return bytes;
+}
+
+static void export_block(export_stream_t *x, const status_sample_t *smp, int n) {
+    static __thread uint64_t col[EXPORT_BLOCK];
+    static __thread uint8_t packed[EXPORT_BLOCK * 8 + 9];
+    uint8_t hdr[4] = {n, n >> 8, n >> 16, n >> 24};
+    export_write(x, hdr, 4, 0);
+    for (int c = 0; c < EXPORT_COLS; c++) {
+        int64_t prev = c == 0 ? (int64_t)smp[0].ts_ms : status_channel(&smp[0], c - 1);
+        uint64_t all = 0;
+        for (int i = 1; i < n; i++) {
+            int64_t v = c == 0 ? (int64_t)smp[i].ts_ms : status_channel(&smp[i], c - 1);
+            col[i-1] = zigzag(v - prev);
+            prev = v;
+            all |= col[i-1];
+        }
+        uint64_t base = c == 0 ? smp[0].ts_ms : (uint64_t)status_channel(&smp[0], c - 1);
+        for (int k = 0; k < 8; k++) packed[k] = base >> (8 * k);
+        int width = all ? 64 - __builtin_clzll(all) : 0;
+        packed[8] = width;
+        export_write(x, packed, 9 + bitpack(packed + 9, col, n - 1, width), 0);
+    }
+}
+
+static int export_produce(conn_t *conn) {
+    export_stream_t *x = conn->ctx;
+    if (x->done) return 0;
+    int nb = 0, last = 0;
+    while (x->next < x->end && nb < EXPORT_BLOCK) {
+        if (!history_get(x->h, x->next++, &x->blk[nb])) continue;
+        if ((int64_t)x->blk[nb].ts_ms > x->to) { last = 1; break; }
+        nb++;
+    }
+    if (nb) export_block(x, x->blk, nb);
+    if (last || x->next >= x->end) {
+        uint8_t term[4] = {0};
+        export_write(x, term, 4, 1);
+        sb_append(&conn->out, "0\r\n\r\n", 5);
+        x->done = 1;
+    }
+    return 1;
+}
+static void export_free(conn_t *conn) {
+    export_stream_t *x = conn->ctx;
+    if (x->gzip) deflateEnd(&x->z);
+    free(x);
+    conn->ctx = NULL;
+}
+
+static int accepts_gzip(const char *req) {
+    const char *h = strcasestr(req, "\r\nAccept-Encoding:");
+    if (!h) return 0;
+    const char *end = strstr(h + 2, "\r\n");
+    const char *g = strcasestr(h, "gzip");
+    return g && (!end || g < end) && strncmp(g + 4, ";q=0", 4) != 0;
+}
+
+static void handle_history_export(conn_t *conn, const char *query, const char *req, bus_sched_t *s) {
+    history_t *h = s->hist;
+    if (!h) { send_404(conn); return; }
+    int64_t now = wall_ms(), from = -3600000, to = 0;
+    query_int64(query, "from", &from);
+    query_int64(query, "to", &to);
+    if (from <= 0) from += now;
+    if (to <= 0) to += now;
+    if (to < from) { send_400(conn, "Invalid from or to"); return; }
+
+    export_stream_t *x = calloc(1, sizeof(*x));
+    if (!x) { send_503(conn, err_nomem); return; }
+    x->conn = conn;
+    x->gzip = accepts_gzip(req);
+    if (x->gzip && deflateInit2(&x->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(x); send_503(conn, err_nomem); return;
+    }
+    x->h = h;
+    x->to = to;
+    x->next = history_seek(h, from);
+    x->end = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+    sb_printf(&conn->out,
+        "HTTP/1.1 200 OK\r\nContent-Type: application/x-kcb5-history\r\n%s"
+        "Transfer-Encoding: chunked\r\nAccess-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n",
+        x->gzip ? "Content-Encoding: gzip\r\n" : "", conn->keepalive ? "keep-alive" : "close");
+
+    uint8_t head[8 + 1 + EXPORT_COLS * 8] = {'K', 'C', 'B', '5', 'H', 'X', 1, 0, EXPORT_COLS};
+    size_t n = 9;
+    head[n++] = 't'; head[n++] = 0;
+    for (int c = 0; c < STATUS_CHANNELS; c++) {
+        size_t l = strlen(status_channel_names[c]) + 1;
+        memcpy(head + n, status_channel_names[c], l);
+        n += l;
+    }
+    export_write(x, head, n, 0);
+    conn->ctx = x;
+    conn->produce = export_produce;
+    conn->produce_free = export_free;
+}
+
+// Request bodies -> bus commands
+// Shared by the single-operation endpoints and /batch. On failure these return
+// NULL with *err set to the client-facing message (err_nomem for allocation).
+
+static bus_cmd_t *cmd_dac(const char *body, const char **err) {
+    // {"value":1234}, optional "channel" (default 0) and "force"
+    int ch = 0, value, force = 0;
+    json_int(body, "channel", &ch);
+    json_bool(body, "force", &force);
+    if (!json_int(body, "value", &value) || ch < 0 || ch >= DAC_CHANNELS || value < 0 || value > 0xffff) {
+        *err = "Invalid channel or value"; return NULL;
+    }
+    bus_cmd_t *c = bus_cmd_new(CMD_DAC, ch, 0);
+    if (!c) { *err = err_nomem; return NULL; }
+    c->v[0] = value; c->force = force;
+    return c;
+}
+
+static bus_cmd_t *cmd_bus(const char *body, const char **err) {
+    // {"bus":"i2c"/"spi", "addr":..., "data":[...]}
+    // I2C addresses are 7-bit, without the reserved 0x00-0x02 and 0x78-0x7f
+    char bus[8];
+    int addr = 0, d[32], nd;
+    if (!json_str(body, "bus", bus, sizeof(bus)) || !json_int(body, "addr", &addr)) {
+        *err = "Invalid JSON or bus"; return NULL;
+    }
+    int kind = strcmp(bus,"i2c")==0 ? CMD_I2C : strcmp(bus,"spi")==0 ? CMD_SPI : -1;
+    if (kind < 0) { *err = "Invalid JSON or bus"; return NULL; }
+    if (kind == CMD_I2C && (addr < 0x03 || addr > 0x77)) { *err = "Invalid addr"; return NULL; }
+    if ((nd = json_bytes(body, d, 32, err)) < 0) return NULL;
+    bus_cmd_t *c = bus_cmd_new(kind, addr, nd);
+    if (!c) { *err = err_nomem; return NULL; }
+    for (int i=0;i<nd;i++) c->data[i]=d[i];
+    return c;
+}
+
+static bus_cmd_t *cmd_servo(const char *body, const char **err) {
+    // {"id":1,"pos":1500,"param":0}, sent as an ICS packet over the ICS UART
+    int id, pos;
+    if (!json_int(body, "id", &id) || !json_int(body, "pos", &pos) ||
+        id < 0 || id >= ICS_IDS || pos < 0 || pos > 0x3fff) {
+        *err = "Invalid id or pos"; return NULL;
+    }
+    bus_cmd_t *c = bus_cmd_new(CMD_SERVO, id, 0);
+    if (!c) { *err = err_nomem; return NULL; }
+    c->v[0] = pos;
+    return c;
+}
+
+static bus_cmd_t *cmd_uart(const char *body, const char **err) {
+    // {"data":[...]}
+    static __thread int d[UART_BUF_SIZE];
+    int nd = json_bytes(body, d, UART_BUF_SIZE, err);
+    if (nd < 0) return NULL;
+    bus_cmd_t *c = bus_cmd_new(CMD_UART, 0, nd);
+    if (!c) { *err = err_nomem; return NULL; }
+    for (int i=0;i<nd;i++) c->data[i]=d[i];
+    return c;
+}
+
+static bus_cmd_t *cmd_pwm(const char *body, const char **err) {
+    // {"channel":1,"duty":50,"period":20000}, optional "force"
+    int ch, duty, period, force = 0;
+    json_bool(body, "force", &force);
+    if (!json_int(body, "channel", &ch) || !json_int(body, "duty", &duty) || !json_int(body, "period", &period) ||
+        ch < 0 || ch >= PWM_CHANNELS || duty < 0 || duty > 100 || period <= 0 || period > 0xffff) {
+        *err = "Invalid channel, duty or period"; return NULL;
+    }
+    bus_cmd_t *c = bus_cmd_new(CMD_PWM, ch, 0);
+    if (!c) { *err = err_nomem; return NULL; }
+    c->v[0] = duty; c->v[1] = period; c->force = force;
+    return c;
+}
+
+static bus_cmd_t *cmd_pio(const char *body, const char **err) {
+    // {"port":1,"value":1}, optional "force"
+    int port, value, force = 0;
+    json_bool(body, "force", &force);
+    if (!json_int(body, "port", &port) || !json_int(body, "value", &value) ||
+        port < 0 || port >= PIO_PORTS || value < 0 || value > 0xff) {
+        *err = "Invalid port or value"; return NULL;
+    }
+    bus_cmd_t *c = bus_cmd_new(CMD_PIO, port, 0);
+    if (!c) { *err = err_nomem; return NULL; }
+    c->v[0] = value; c->force = force;
+    return c;
+}
+
+static void submit_cmd(conn_t *conn, bus_sched_t *s, bus_cmd_t *c, const char *err) {
+    if (!c) {
+        if (err == err_nomem) send_503(conn, err_nomem);
+        else send_400(conn, err ? err : "Invalid request");
+        return;
+    }
+    if (!link_cfg.hold && link_down(s, c->kind)) {
+        bus_cmd_free(c);
+        send_retry(conn, "503 Service Unavailable", 1);
+        return;
+    }
+    c->client = conn->client;
+    c->client_ms = conn->client_ms;
+    sched_submit(s, c);
+    send_204(conn);
+}
+
+// /dac - PUT
+static void handle_dac(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_dac(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /bus - PUT
+static void handle_bus(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_bus(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /servo - PUT
+static void handle_servo(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_servo(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /uart - POST
+static void handle_uart(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_uart(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /pwm - PUT
+static void handle_pwm(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_pwm(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /pio - PUT
+static void handle_pio(conn_t *conn, const char *body, bus_sched_t *s) {
+    const char *err = NULL;
+    bus_cmd_t *c = cmd_pio(body, &err);
+    submit_cmd(conn, s, c, err);
+}
+
+// /watchdog - PUT
+// Heartbeat for the X-Client-Id watchdog: keeps the client's targets where
+// they are without writing them. Bare /watchdog reaches every board.
+static void handle_watchdog(conn_t *conn, bus_sched_t *only) {
+    if (!conn->client) { send_400(conn, "Missing X-Client-Id"); return; }
+    for (int b = 0; b < nboards; b++) {
+        if (only && only != &boards[b].sched) continue;
+        bus_cmd_t *c = bus_cmd_new(CMD_HEARTBEAT, 0, 0);
+        if (!c) { send_503(conn, err_nomem); return; }
+        c->client = conn->client;
+        c->client_ms = conn->client_ms;
+        sched_submit(&boards[b].sched, c);
+    }
+    send_204(conn);
+}
+
+// A write given as {"op":"servo"|"pio"|"pwm"|"dac"|"bus"|"uart", ...}.
+static bus_cmd_t *cmd_parse_op(const char *obj, const char **err) {
+    static const struct { const char *name; bus_cmd_t *(*parse)(const char*, const char**); } ops[] = {
+        {"servo", cmd_servo}, {"pio", cmd_pio}, {"pwm", cmd_pwm},
+        {"dac", cmd_dac}, {"bus", cmd_bus}, {"uart", cmd_uart},
+    };
+    char name[16];
+    *err = "Unknown op";
+    if (json_str(obj, "op", name, sizeof(name)))
+        for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++)
+            if (strcmp(name, ops[i].name) == 0) return ops[i].parse(obj, err);
+    return NULL;
+}
+
+// /batch - POST
+// {"ops":[{"op":"pio","port":1,"value":1,"delay_ms":20}, ...]} (or a bare array).
+// Every op is validated before anything is queued; the batch then runs as one
+// unit on the bus worker and the response carries a result per op. The event
+// loop and, during step delays, the worker keep serving other clients
+// meanwhile; batch_done answers this one.
+// An op may name another "board"; see the batch section for how that runs.
+static void batch_part_done(void *arg);
+
+static void handle_batch(conn_t *conn, const char *body, bus_sched_t *s) {
+    batch_t *b = batch_new();
+    if (!b) { send_503(conn, err_nomem); return; }
+    const char *p = strchr(body, '[');
+    const char *o = json_field(body, "ops");
+    if (o) p = *o == '[' ? o : NULL;
+    if (!p) { batch_free(b); send_400(conn, "Missing ops"); return; }
+    char *obj = arena_alloc(&conn->arena, MAX_REQ_SIZE), msg[128];
+    size_t olen;
+    if (!obj) { batch_free(b); send_503(conn, err_nomem); return; }
+    p++;
+    while ((p = json_next_object(p, obj, MAX_REQ_SIZE, &olen))) {
+        if (b->n == BATCH_MAX_OPS) { batch_free(b); send_400(conn, "Too many ops"); return; }
+        const char *err;
+        bus_cmd_t *c = cmd_parse_op(obj, &err);
+        int delay = 0;
+        json_int(obj, "delay_ms", &delay);
+        if (c && (delay < 0 || delay > BATCH_MAX_DELAY_MS)) { bus_cmd_free(c); c = NULL; err = "Invalid delay_ms"; }
+        bus_sched_t *on = s;
+        char bid[32];
+        if (c && json_str(obj, "board", bid, sizeof(bid)) && !(on = board_find(bid, strlen(bid)))) {
+            bus_cmd_free(c); c = NULL; err = "Unknown board";
+        }
+        if (!c) {
+            snprintf(msg, sizeof(msg), "op %d: %s", b->n, err);
+            batch_free(b);
+            if (err == err_nomem) send_503(conn, err_nomem);
+            else send_400(conn, msg);
+            return;
+        }
+        c->client = conn->client;
+        c->client_ms = conn->client_ms;
+        b->step[b->n].cmd = c;
+        b->step[b->n].delay_ms = delay;
+        b->step[b->n].board = on;
+        b->n++;
+    }
+    if (olen == (size_t)-1) { batch_free(b); send_400(conn, "Malformed ops"); return; }
+    if (b->n == 0) { batch_free(b); send_400(conn, "Missing ops"); return; }
+
+    // One part per board in order of first use, all built before any is queued.
+    batch_t *part[BATCH_MAX_OPS];
+    bus_cmd_t *pc[BATCH_MAX_OPS];
+    int np = 0;
+    for (int i = 0; i < b->n; i++) {
+        int k = 0;
+        while (k < np && part[k]->step[0].board != b->step[i].board) k++;
+        if (k == np) {
+            part[np] = batch_new();
+            pc[np] = bus_cmd_new(CMD_BATCH, 0, 0);
+            if (!part[np++] || !pc[k]) {
+                for (int j = 0; j < np; j++) { free(part[j]); bus_cmd_free(pc[j]); }
+                batch_free(b); send_503(conn, err_nomem); return;
+            }
+            part[k]->parent = b;
+            part[k]->done.fn = batch_part_done;
+            part[k]->done.arg = part[k];
+            pc[k]->batch = part[k];
+        }
+        batch_step_t *st = &part[k]->step[part[k]->n++];
+        *st = b->step[i];
+        st->index = i;
+    }
+    b->owner = conn;
+    b->pending = np;
+    b->t_submit = now_ns();
+    conn->state = CONN_BUSY;
+    conn_watch(conn, EPOLLRDHUP);
+    conn_timeout(conn, 0);
+    for (int k = 0; k < np; k++) sched_submit(part[k]->step[0].board, pc[k]);
+}
+
+// Runs on the event loop once every part of the batch has finished.
+static void batch_done(batch_t *b) {
+    conn_t *conn = b->owner;
+    uint64_t elapsed = now_ns() - b->t_submit;
+    size_t cap = 128 + b->n * 144, n = 0;
+    char *json = conn->dead ? NULL : arena_alloc(&conn->arena, cap);
+    if (!json) { batch_free(b); if (!conn->dead) send_503(conn, err_nomem); conn_resume(conn); return; }
+    n += snprintf(json + n, cap - n, "{\"ok\":%s,\"failed\":%d,\"elapsed_us\":%llu,\"results\":[",
+        b->failed < 0 ? "true" : "false", b->failed, (unsigned long long)(elapsed / 1000));
+    for (int i = 0; i < b->n; i++) {
+        n += snprintf(json + n, cap - n, "%s{\"op\":\"%s\",\"board\":\"%s\",\"status\":\"%s\",\"bus_us\":%u}",
+            i ? "," : "", cmd_names[b->step[i].cmd->kind], b->step[i].board->id,
+            batch_status_names[b->step[i].status], b->step[i].bus_us);
+    }
+    n += snprintf(json + n, cap - n, "]}");
+    send_response_buf(conn, b->failed < 0 ? "200 OK" : "502 Bad Gateway", "application/json", json, n);
+    batch_free(b);
+    conn_resume(conn);
+}
+
+static void batch_part_done(void *arg) {
+    batch_t *part = arg, *b = part->parent;
+    for (int i = 0; i < part->n; i++) {
+        batch_step_t *st = &part->step[i];
+        b->step[st->index].status = st->status;
+        b->step[st->index].bus_us = st->bus_us;
+        if (part->failed == i && (b->failed < 0 || st->index < b->failed)) b->failed = st->index;
+    }
+    free(part);                 // the commands belong to the request batch
+    if (--b->pending == 0) batch_done(b);
+}
+
+// Sequences
+// Named programs, uploaded with PUT /sequences/{name} and started with one
+// POST, that a board's worker runs in-process so consecutive steps are not
+// separated by HTTP round trips. Steps are the batch ops plus
+// {"op":"delay","ms":..}, {"op":"wait",...} on a DIP switch or A/D input, and
+// {"op":"loop","count":..} ... {"op":"end"}. A document is validated and
+// compiled once into bytecode, one instruction per step with a write holding
+// only the bytes its kind needs. The worker interprets a run cooperatively:
+// delays and waits are timers on its wheel and it yields every SEQ_SLICE
+// instructions, so queued commands, watchdogs and other runs go on in
+// between. A wait requests the board status every poll_ms and checks each
+// reply that came in since it began until the condition holds or timeout_ms
+// passes. Writes go through the watchdog,
+// shadows and journal like any other; the first failing one ends the run,
+// without rollback. Programs are immutable and counted, so replacing or
+// deleting one leaves runs in progress alone. With SEQUENCE_DIR set the
+// documents are kept there and loaded at startup.
+#define SEQ_MAX 64
+#define SEQ_MAX_STEPS 256
+#define SEQ_MAX_CODE 8192
+#define SEQ_MAX_DEPTH 8
+#define SEQ_MAX_MS 600000
+#define SEQ_SLICE 64
+#define SEQ_CHECK_MS 50             // longest a delay goes without looking for a stop
+
+// Opcodes; a write is its command kind, with SEQ_FORCE set when forced.
+enum { SEQ_END = 0x10, SEQ_DELAY, SEQ_WAIT, SEQ_LOOP, SEQ_NEXT };
+#define SEQ_FORCE 0x80
+
+enum { SEQ_RUNNING, SEQ_OK, SEQ_FAILED, SEQ_TIMEOUT, SEQ_STOPPED };
+static const char *seq_status_names[] = {"running", "ok", "failed", "timeout", "stopped"};
+
+typedef struct {
+    char name[32];
+    int refs;                       // the table's and one per run; event loop only
+    _Atomic unsigned stop;          // bumped by .../stop, ends the runs started before
+    int nsteps;
+    size_t len;
+    char *src;                      // the document as uploaded
+    uint16_t step_pc[SEQ_MAX_STEPS];    // first instruction of each step
+    uint8_t code[];
+} seq_prog_t;
+
+typedef struct seq_run {
+    wtimer_t timer;                 // first: delays, waits and yields resume here
+    seq_prog_t *prog;
+    unsigned stop;
+    uint32_t pc, at;                // next instruction, the one last started
+    uint32_t client;
+    int client_ms, depth, status;
+    struct { uint32_t pc, left; } loop[SEQ_MAX_DEPTH];
+    uint64_t until;                 // end of the delay or wait in progress, 0: none
+    uint64_t replies;               // wait: status replies taken before it began
+    uint64_t t_start, writes;
+    void *owner;                    // connection waiting for the result
+    post_t done;
+} seq_run_t;
+
+static struct {
+    seq_prog_t *prog[SEQ_MAX];
+    int n;
+    const char *dir;
+    uint64_t runs, failed;
+} seqs;
+
+// A write instruction: opcode, then the fields of its kind, little-endian.
+static size_t seq_encode(uint8_t *p, const bus_cmd_t *c) {
+    p[0] = c->kind | (c->force ? SEQ_FORCE : 0);
+    switch (c->kind) {
+    case CMD_SERVO: p[1] = c->target; put_le16(p + 2, c->v[0]); return 4;
+    case CMD_PIO:   p[1] = c->target; p[2] = c->v[0]; return 3;
+    case CMD_PWM:   p[1] = c->target; p[2] = c->v[0]; put_le16(p + 3, c->v[1]); return 5;
+    case CMD_DAC:   p[1] = c->target; put_le16(p + 2, c->v[0]); return 4;
+    case CMD_UART:  put_le16(p + 1, c->len); memcpy(p + 3, c->data, c->len); return 3 + c->len;
+    }
+    put_le16(p + 1, c->target); p[3] = c->len; memcpy(p + 4, c->data, c->len);   // I2C, SPI
+    return 4 + c->len;
+}
+
+static size_t seq_decode(const uint8_t *p, bus_cmd_t *c) {
+    c->kind = p[0] & ~SEQ_FORCE;
+    c->force = (p[0] & SEQ_FORCE) != 0;
+    switch (c->kind) {
+    case CMD_SERVO: c->target = p[1]; c->v[0] = get_le16(p + 2); return 4;
+    case CMD_PIO:   c->target = p[1]; c->v[0] = p[2]; return 3;
+    case CMD_PWM:   c->target = p[1]; c->v[0] = p[2]; c->v[1] = get_le16(p + 3); return 5;
+    case CMD_DAC:   c->target = p[1]; c->v[0] = get_le16(p + 2); return 4;
+    case CMD_UART:  c->len = get_le16(p + 1); memcpy(c->data, p + 3, c->len); return 3 + c->len;
+    }
+    c->target = get_le16(p + 1); c->len = p[3]; memcpy(c->data, p + 4, c->len);
+    return 4 + c->len;
+}
+
+// Wait: source (0 DIP, 1 A/D), index, comparison (0 equal, 1 above, 2 below),
+// level16, poll_ms16, timeout_ms32.
+static int seq_cond(const status_sample_t *st, const uint8_t *p) {
+    int v = p[1] ? st->ad[p[2]] : st->dip >> p[2] & 1, x = get_le16(p + 4);
+    return p[3] == 1 ? v > x : p[3] == 2 ? v < x : v == x;
+}
+
+static void seq_finish(seq_run_t *r, int status) {
+    r->status = status;
+    loop_post(&r->done);
+}
+
+// Worker only. Runs r until it has to wait, yields or ends.
+static void seq_exec(bus_sched_t *s, seq_run_t *r) {
+    union { bus_cmd_t c; uint8_t raw[sizeof(bus_cmd_t) + UART_BUF_SIZE]; } w;
+    bus_link_t *uart = &s->link[BUS_UART];
+    for (int n = 0; n < SEQ_SLICE; n++) {
+        if (atomic_load_explicit(&r->prog->stop, memory_order_relaxed) != r->stop) { seq_finish(r, SEQ_STOPPED); return; }
+        const uint8_t *p = r->prog->code + r->pc;
+        uint64_t now = now_ns(), left;
+        r->at = r->pc;
+        switch (p[0]) {
+        case SEQ_END:
+            seq_finish(r, SEQ_OK);
+            return;
+        case SEQ_DELAY:
+            if (!r->until) r->until = now + (uint64_t)get_le32(p + 1) * 1000000;
+            if (now >= r->until) { r->until = 0; r->pc += 5; continue; }
+            left = (r->until - now) / 1000000;
+            twheel_add(&s->wheel, &r->timer, left < SEQ_CHECK_MS ? left : SEQ_CHECK_MS);
+            return;
+        case SEQ_WAIT:
+            if (!uart->path) { seq_finish(r, SEQ_FAILED); return; }
+            // Only replies to requests sent since the wait began count.
+            if (!r->until) {
+                r->until = now + (uint64_t)get_le32(p + 8) * 1000000;
+                r->replies = s->rx_replies + s->rx_wait;
+            }
+            if (s->rx_replies > r->replies && seq_cond(&s->status.cur, p)) {
+                r->until = 0; r->pc += 12; continue;
+            }
+            if (now >= r->until) { seq_finish(r, SEQ_TIMEOUT); return; }
+            if (atomic_load(&uart->state) == LINK_UP) status_request(s);
+            left = (r->until - now) / 1000000;
+            twheel_add(&s->wheel, &r->timer, left < get_le16(p + 6) ? left : get_le16(p + 6));
+            return;
+        case SEQ_LOOP:
+            r->pc += 3;
+            r->loop[r->depth].pc = r->pc;
+            r->loop[r->depth++].left = get_le16(p + 1);
+            continue;
+        case SEQ_NEXT:
+            if (--r->loop[r->depth - 1].left) r->pc = r->loop[r->depth - 1].pc;
+            else { r->depth--; r->pc++; }
+            continue;
+        }
+        memset(&w.c, 0, sizeof(w.c));
+        r->pc += seq_decode(p, &w.c);
+        w.c.client = r->client;
+        w.c.client_ms = r->client_ms;
+        watchdog_feed(s, &w.c);
+        r->writes++;
+        if (sched_apply(s, &w.c) < 0) { seq_finish(r, SEQ_FAILED); return; }
+    }
+    twheel_add(&s->wheel, &r->timer, 0);
+}
+
+static void seq_resume(wtimer_t *t) { seq_exec(t->arg, (seq_run_t *)t); }
+
+static int seq_name_ok(const char *name) {
+    size_t n = strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.");
+    return n && n < sizeof(((seq_prog_t *)0)->name) && !name[n] && name[0] != '.';
+}
+
+static int seq_index(const char *name) {
+    for (int i = 0; i < seqs.n; i++)
+        if (strcmp(seqs.prog[i]->name, name) == 0) return i;
+    return -1;
+}
+
+static void seq_put(seq_prog_t *p) {
+    if (--p->refs > 0) return;
+    free(p->src);
+    free(p);
+}
+
+// {"op":"wait","dip":2,"value":1} or {"op":"wait","ad":0,"above":512} ("below",
+// "value"), optional "timeout_ms" (default 5000) and "poll_ms" (default 10).
+static const char *seq_wait(const char *obj, uint8_t *at) {
+    int i, x = -1, cmp = 0, timeout = 5000, poll = 10, ad = 0;
+    if (json_int(obj, "dip", &i)) {
+        if (i < 0 || i > 7 || !json_int(obj, "value", &x) || (x != 0 && x != 1)) return "Invalid dip or value";
+    } else if (json_int(obj, "ad", &i)) {
+        ad = 1;
+        if (json_int(obj, "above", &x)) cmp = 1;
+        else if (json_int(obj, "below", &x)) cmp = 2;
+        else json_int(obj, "value", &x);
+        if (i < 0 || i > 3 || x < 0 || x > 0xffff) return "Invalid ad or level";
+    } else return "Missing dip or ad";
+    json_int(obj, "timeout_ms", &timeout);
+    json_int(obj, "poll_ms", &poll);
+    if (timeout < 0 || timeout > SEQ_MAX_MS || poll < 1 || poll > 1000) return "Invalid timeout_ms or poll_ms";
+    at[0] = SEQ_WAIT; at[1] = ad; at[2] = i; at[3] = cmp;
+    put_le16(at + 4, x); put_le16(at + 6, poll); put_le32(at + 8, timeout);
+    return NULL;
+}
+
+// Compiles a {"steps":[...]} document (or a bare array). On failure returns
+// NULL with *err pointing at err_nomem or at the message written to msg.
+static seq_prog_t *seq_compile(const char *name, const char *body, char *obj, const char **err, char *msg, size_t cap) {
+    seq_prog_t *p = calloc(1, sizeof(*p) + SEQ_MAX_CODE);
+    if (!p || !(p->src = strdup(body))) { free(p); *err = err_nomem; return NULL; }
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    const char *a = strchr(body, '['), *o = json_field(body, "steps"), *e = NULL;
+    if (o) a = *o == '[' ? o : NULL;
+    int depth = 0, step = -1;
+    size_t olen = 0;
+    if (a) a++;
+    else e = "Missing steps";
+    while (!e && (a = json_next_object(a, obj, MAX_REQ_SIZE, &olen))) {
+        char op[16];
+        int v, delay = 0;
+        uint8_t *at = p->code + p->len;
+        step = p->nsteps;
+        if (step == SEQ_MAX_STEPS) { e = "Too many steps"; break; }
+        if (p->len + 5 + 4 + UART_BUF_SIZE + 1 > SEQ_MAX_CODE) { e = "Program too large"; break; }
+        p->step_pc[step] = p->len;
+        if (!json_str(obj, "op", op, sizeof(op))) op[0] = 0;
+        if (strcmp(op, "delay") == 0) {
+            if (!json_int(obj, "ms", &v) || v < 0 || v > SEQ_MAX_MS) { e = "Invalid ms"; break; }
+            at[0] = SEQ_DELAY; put_le32(at + 1, v); p->len += 5;
+        } else if (strcmp(op, "wait") == 0) {
+            if ((e = seq_wait(obj, at))) break;
+            p->len += 12;
+        } else if (strcmp(op, "loop") == 0) {
+            if (!json_int(obj, "count", &v) || v < 1 || v > 0xffff) { e = "Invalid count"; break; }
+            if (depth == SEQ_MAX_DEPTH) { e = "Loops nested too deep"; break; }
+            depth++;
+            at[0] = SEQ_LOOP; put_le16(at + 1, v); p->len += 3;
+        } else if (strcmp(op, "end") == 0) {
+            if (depth-- == 0) { e = "end without loop"; break; }
+            at[0] = SEQ_NEXT; p->len++;
+        } else {
+            bus_cmd_t *c = cmd_parse_op(obj, &e);
+            if (!c) break;
+            json_int(obj, "delay_ms", &delay);
+            if (delay < 0 || delay > BATCH_MAX_DELAY_MS) e = "Invalid delay_ms";
+            else if ((c->kind == CMD_I2C || c->kind == CMD_SPI) && (c->target < 0 || c->target > 0xffff)) e = "Invalid addr";
+            else e = NULL;
+            if (!e && delay) { at[0] = SEQ_DELAY; put_le32(at + 1, delay); at += 5; p->len += 5; }
+            if (!e) p->len += seq_encode(at, c);
+            bus_cmd_free(c);
+            if (e) break;
+        }
+        p->nsteps++;
+    }
+    if (!e) {
+        step = -1;
+        if (olen == (size_t)-1) e = "Malformed steps";
+        else if (!p->nsteps) e = "Missing steps";
+        else if (depth) e = "loop without end";
+    }
+    if (e) {
+        if (e == err_nomem) *err = e;
+        else if (step >= 0) snprintf(msg, cap, "step %d: %s", step, e), *err = msg;
+        else *err = e;
+        free(p->src);
+        free(p);
+        return NULL;
+    }
+    p->code[p->len++] = SEQ_END;
+    seq_prog_t *shrunk = realloc(p, sizeof(*p) + p->len);
+    return shrunk ? shrunk : p;
+}
+
+// Writes the document to SEQUENCE_DIR, replacing any older one in one step.
+static int seq_save(const seq_prog_t *p) {
+    if (!seqs.dir) return 0;
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    snprintf(path, sizeof(path), "%s/%s.json", seqs.dir, p->name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    size_t n = strlen(p->src);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write(fd, p->src, n) == (ssize_t)n && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (ok && rename(tmp, path) == 0) return 0;
+    perror(tmp);
+    unlink(tmp);
+    return -1;
+}
+
+static void seq_store(seq_prog_t *p) {
+    int i = seq_index(p->name);
+    p->refs = 1;
+    if (i < 0) seqs.prog[seqs.n++] = p;
+    else { seq_put(seqs.prog[i]); seqs.prog[i] = p; }
+}
+
+static void seq_load(void) {
+    if (!(seqs.dir = getenv("SEQUENCE_DIR"))) return;
+    DIR *d = opendir(seqs.dir);
+    char *buf = malloc(MAX_REQ_SIZE + 1), *obj = malloc(MAX_REQ_SIZE), msg[128];
+    struct dirent *de;
+    if (!d) perror(seqs.dir);
+    while (d && buf && obj && (de = readdir(d))) {
+        char name[32], path[PATH_MAX];
+        size_t n = strlen(de->d_name);
+        if (n <= 5 || n - 5 >= sizeof(name) || strcmp(de->d_name + n - 5, ".json") != 0) continue;
+        memcpy(name, de->d_name, n - 5);
+        name[n - 5] = 0;
+        if (!seq_name_ok(name)) continue;
+        snprintf(path, sizeof(path), "%s/%s", seqs.dir, de->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t r = fd >= 0 ? read(fd, buf, MAX_REQ_SIZE + 1) : -1;
+        if (fd >= 0) close(fd);
+        const char *err = r < 0 ? strerror(errno) : "Too large";
+        seq_prog_t *p = NULL;
+        if (r >= 0 && r <= MAX_REQ_SIZE) {
+            buf[r] = 0;
+            p = seq_compile(name, buf, obj, &err, msg, sizeof(msg));
+        }
+        if (p && seqs.n == SEQ_MAX) { err = "Too many sequences"; seq_put(p); p = NULL; }
+        if (p) seq_store(p);
+        else fprintf(stderr, "%s: %s\n", path, err);
+    }
+    if (d) closedir(d);
+    free(buf);
+    free(obj);
+}
+
+// Runs on the event loop once the worker is done with the run.
+static void seq_done(void *arg) {
+    seq_run_t *r = arg;
+    conn_t *conn = r->owner;
+    seqs.runs++;
+    if (r->status != SEQ_OK) seqs.failed++;
+    if (!conn->dead) {
+        int step = -1;
+        if (r->status != SEQ_OK)
+            for (step = 0; step + 1 < r->prog->nsteps && r->prog->step_pc[step + 1] <= r->at; step++) ;
+        char json[192];
+        snprintf(json, sizeof(json), "{\"ok\":%s,\"status\":\"%s\",\"step\":%d,\"writes\":%llu,\"elapsed_us\":%llu}",
+            r->status == SEQ_OK ? "true" : "false", seq_status_names[r->status], step,
+            (unsigned long long)r->writes, (unsigned long long)((now_ns() - r->t_start) / 1000));
+        send_response(conn, r->status == SEQ_OK ? "200 OK" : "502 Bad Gateway", "application/json", json);
+    }
+    seq_put(r->prog);
+    free(r);
+    conn_resume(conn);
+}
+
+static void seq_start(conn_t *conn, seq_prog_t *p, bus_sched_t *s) {
+    seq_run_t *r = calloc(1, sizeof(*r));
+    bus_cmd_t *c = bus_cmd_new(CMD_SEQ, 0, 0);
+    if (!r || !c) { free(r); bus_cmd_free(c); send_503(conn, err_nomem); return; }
+    r->timer = (wtimer_t){.fn = seq_resume, .arg = s};
+    r->prog = p;
+    p->refs++;
+    r->stop = atomic_load(&p->stop);
+    r->client = conn->client;
+    r->client_ms = conn->client_ms;
+    r->t_start = now_ns();
+    r->owner = conn;
+    r->done = (post_t){.fn = seq_done, .arg = r};
+    c->run = r;
+    conn->state = CONN_BUSY;
+    conn_watch(conn, EPOLLRDHUP);
+    conn_timeout(conn, 0);
+    sched_submit(s, c);
+}
+
+// /sequences - GET; /sequences/{name} - GET, PUT, DELETE;
+// /sequences/{name}/run, /sequences/{name}/stop - POST
+// PUT takes {"steps":[...]} and answers with the compiled size; GET returns
+// the document as uploaded. run answers when the run is over: 200 once every
+// step went through, else 502 with the status and the step it ended on.
+// stop ends every run of the program in progress.
+static void handle_sequences(conn_t *conn, const char *method, char *path, const char *body, bus_sched_t *s) {
+    if (!*path) {
+        if (strcmp(method, "GET") != 0) { send_405(conn); return; }
+        strbuf_t b = sb_scratch(conn);
+        int err = sb_printf(&b, "{\"sequences\":[");
+        for (int i = 0; i < seqs.n; i++)
+            err |= sb_printf(&b, "%s{\"name\":\"%s\",\"steps\":%d,\"bytes\":%zu}",
+                i ? "," : "", seqs.prog[i]->name, seqs.prog[i]->nsteps, seqs.prog[i]->len);
+        err |= sb_printf(&b, "],\"runs\":%llu,\"failed\":%llu}",
+            (unsigned long long)seqs.runs, (unsigned long long)seqs.failed);
+        if (err) send_503(conn, err_nomem);
+        else send_response_buf(conn, "200 OK", "application/json", b.buf, b.len);
+        sb_rewind(&b);
+        return;
+    }
+    char *name = path + 1, *action = strchr(name, '/');
+    if (action) *action++ = 0;
+    int i = seq_name_ok(name) ? seq_index(name) : -1;
+    seq_prog_t *p = i >= 0 ? seqs.prog[i] : NULL;
+    if (action) {
+        if (strcmp(action, "run") != 0 && strcmp(action, "stop") != 0) send_404(conn);
+        else if (strcmp(method, "POST") != 0) send_405(conn);
+        else if (!p) send_404(conn);
+        else if (action[0] == 's') { atomic_fetch_add(&p->stop, 1); send_204(conn); }
+        else seq_start(conn, p, s);
+    } else if (strcmp(method, "GET") == 0) {
+        if (p) send_json(conn, p->src);
+        else send_404(conn);
+    } else if (strcmp(method, "DELETE") == 0) {
+        if (!p) { send_404(conn); return; }
+        if (seqs.dir) {
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/%s.json", seqs.dir, name);
+            if (unlink(file) < 0 && errno != ENOENT) perror(file);
+        }
+        seqs.prog[i] = seqs.prog[--seqs.n];
+        seq_put(p);
+        send_204(conn);
+    } else if (strcmp(method, "PUT") == 0) {
+        if (!seq_name_ok(name)) { send_400(conn, "Invalid name"); return; }
+        if (!p && seqs.n == SEQ_MAX) { send_400(conn, "Too many sequences"); return; }
+        char *obj = arena_alloc(&conn->arena, MAX_REQ_SIZE), msg[128], json[96];
+        const char *err = err_nomem;
+        seq_prog_t *np = obj ? seq_compile(name, body, obj, &err, msg, sizeof(msg)) : NULL;
+        if (!np) {
+            if (err == err_nomem) send_503(conn, err);
+            else send_400(conn, err);
+            return;
+        }
+        if (seq_save(np) < 0) {
+            np->refs = 1;
+            seq_put(np);
+            send_response(conn, "500 Internal Server Error", "application/json", "{\"error\":\"Cannot save\"}");
+            return;
+        }
+        seq_store(np);
+        snprintf(json, sizeof(json), "{\"name\":\"%s\",\"steps\":%d,\"bytes\":%zu}", np->name, np->nsteps, np->len);
+        send_response(conn, p ? "200 OK" : "201 Created", "application/json", json);
+    } else {
+        send_405(conn);
+    }
+}
+
+// Staged updates
+// Setpoints that have to change together (an arm's servos, a gripper's PWM
+// and a PIO line) are written to a staging area with PUT /stage and go out
+// on POST /commit. Each board keeps one area per X-Client-Id (one shared
+// without), where a later write to a target replaces the earlier one, so an
+// area holds at most one write per servo, PIO port, PWM and DAC channel. The
+// worker takes a commit as one command: it refuses it whole while a bus it
+// needs is down, drops writes equal to the shadows as usual, then builds all
+// ICS packets into one buffer and all board UART frames into another and
+// writes the two back to back. The reply carries the skew between the two
+// flushes as measured, each bus's write time and its time on the wire at the
+// configured rate. A bus failing mid-commit is not rolled back.
+// An area nobody has written to for STAGE_TTL_MS is dropped, so clients that
+// stage and go away do not keep the table full.
+#define STAGE_MAX 64
+#define STAGE_MAX_OPS (ICS_IDS + PIO_PORTS + PWM_CHANNELS + DAC_CHANNELS)
+
+enum { FLUSH_ICS, FLUSH_UART, FLUSHES };
+
+typedef struct stage {
+    struct stage *next;
+    bus_sched_t *board;
+    uint32_t client;                // X-Client-Id, 0: shared
+    int n, failed;                  // failed: bus that failed, -1 for none
+    bus_cmd_t *cmd[STAGE_MAX_OPS];
+    int result[STAGE_MAX_OPS];      // as sched_issue
+    struct { size_t bytes; uint64_t start, write_ns; } flush[FLUSHES];
+    uint64_t t_submit;
+    void *owner;                    // connection waiting for the result
+    post_t done;
+    wtimer_t expiry;                // on the loop's wheel while staged
+} stage_t;
+
+static struct {
+    stage_t *list;
+    int n;
+    int ttl_ms;                     // STAGE_TTL_MS, 0: never expire
+} stages;
+
+// Worker only.
+static void commit_exec(bus_sched_t *s, stage_t *st) {
+    uint8_t buf[FLUSHES][STAGE_MAX_OPS * 16];
+    uart_handle_t *h[FLUSHES] = {s->ics, s->uart};
+    int bus[FLUSHES] = {BUS_ICS, BUS_UART};
+    for (int i = 0; i < st->n; i++) watchdog_feed(s, st->cmd[i]);
+    for (int i = 0; i < st->n; i++) {
+        if (!link_down(s, st->cmd[i]->kind)) continue;
+        st->failed = cmd_link(st->cmd[i]->kind);
+        for (int k = 0; k < st->n; k++) st->result[k] = -1;
+        atomic_fetch_add_explicit(&s->errors, st->n, memory_order_relaxed);
+        loop_post(&st->done);
+        return;
+    }
+    for (int i = 0; i < st->n; i++) {
+        bus_cmd_t *c = st->cmd[i];
+        shadow_t *sh = sched_shadow(s, c);
+        if (sh && sh->valid && !c->force && sh->v[0] == c->v[0] && sh->v[1] == c->v[1]) {
+            atomic_fetch_add_explicit(&s->suppressed, 1, memory_order_relaxed);
+            continue;
+        }
+        uint8_t p[4];
+        int f = c->kind == CMD_SERVO ? FLUSH_ICS : FLUSH_UART;
+        uint8_t *at = buf[f] + st->flush[f].bytes;
+        st->result[i] = 1;
+        if (!h[f] || h[f]->fd <= 0) continue;  // bus not configured: a no-op, as in sched_exec
+        switch (c->kind) {
+        case CMD_SERVO:
+            at[0] = 0x80 | c->target; at[1] = (c->v[0] >> 7) & 0x7f; at[2] = c->v[0] & 0x7f;
+            st->flush[f].bytes += 3;
+            break;
+        case CMD_PIO:
+            p[0] = c->target; p[1] = c->v[0];
+            st->flush[f].bytes += kcb_frame(at, KCB_CMD_PIO, p, 2);
+            break;
+        case CMD_PWM:
+            p[0] = c->target; p[1] = c->v[0]; p[2] = c->v[1] >> 8; p[3] = c->v[1];
+            st->flush[f].bytes += kcb_frame(at, KCB_CMD_PWM, p, 4);
+            break;
+        case CMD_DAC:
+            p[0] = c->target; p[1] = c->v[0] >> 8; p[2] = c->v[0];
+            st->flush[f].bytes += kcb_frame(at, KCB_CMD_DAC, p, 3);
+            break;
+        }
+    }
+    trace_req = st->cmd[0]->req;
+    for (int f = 0; f < FLUSHES; f++) {
+        if (!st->flush[f].bytes) continue;
+        st->flush[f].start = now_ns();
+        ssize_t r = uart_write(h[f], buf[f], st->flush[f].bytes);
+        st->flush[f].write_ns = now_ns() - st->flush[f].start;
+        if (r == (ssize_t)st->flush[f].bytes) continue;
+        if (link_torn(s, bus[f]) || link_gone(bus[f], errno)) link_lost(s, bus[f], errno);
+        if (st->failed < 0) st->failed = bus[f];
+    }
+    for (int i = 0; i < st->n; i++) {
+        bus_cmd_t *c = st->cmd[i];
+        int f = c->kind == CMD_SERVO ? FLUSH_ICS : FLUSH_UART;
+        shadow_t *sh = sched_last(s, c);
+        if (st->result[i] && st->failed == bus[f]) {
+            st->result[i] = -1;
+            atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+            if (sh) sh->valid = 0;
+        } else if (st->result[i]) {
+            atomic_fetch_add_explicit(&s->issued, 1, memory_order_relaxed);
+            if (sh) { sh->valid = 1; sh->v[0] = c->v[0]; sh->v[1] = c->v[1]; }
+        }
+        if (s->jnl) journal_append(s->jnl, c, st->result[i], st->flush[f].write_ns);
+    }
+    loop_post(&st->done);
+}
+
+static void stage_free(stage_t *st) {
+    for (int i = 0; i < st->n; i++) bus_cmd_free(st->cmd[i]);
+    free(st);
+}
+
+static const char *stage_kind(const bus_cmd_t *c) {
+    return c->kind == CMD_SERVO || c->kind == CMD_PIO || c->kind == CMD_PWM || c->kind == CMD_DAC ?
+        NULL : "Only servo, pio, pwm and dac can be staged";
+}
+
+static stage_t **stage_find(bus_sched_t *s, uint32_t client) {
+    stage_t **pp = &stages.list;
+    while (*pp && ((*pp)->board != s || (*pp)->client != client)) pp = &(*pp)->next;
+    return pp;
+}
+
+// Takes the area *pp out of the table; the caller frees or commits it.
+static stage_t *stage_unlink(stage_t **pp) {
+    stage_t *st = *pp;
+    *pp = st->next;
+    stages.n--;
+    twheel_del(&loop.wheel, &st->expiry);
+    return st;
+}
+
+static void stage_expire(wtimer_t *t) {
+    stage_t *st = t->arg;
+    stage_free(stage_unlink(stage_find(st->board, st->client)));
+}
+
+// Runs on the event loop once the worker has sent the commit.
+static void commit_done(void *arg) {
+    stage_t *st = arg;
+    conn_t *conn = st->owner;
+    if (!conn->dead) {
+        static const char *flush_names[FLUSHES] = {"ics", "uart"};
+        int baud = sched_cfg(st->board).uart.baud, issued = 0, suppressed = 0;
+        for (int i = 0; i < st->n; i++) {
+            issued += st->result[i] > 0;
+            suppressed += st->result[i] == 0;
+        }
+        uint64_t a = st->flush[FLUSH_ICS].start, b = st->flush[FLUSH_UART].start;
+        char json[384], failed[16] = "null";
+        if (st->failed >= 0) snprintf(failed, sizeof(failed), "\"%s\"", bus_names[st->failed]);
+        size_t n = snprintf(json, sizeof(json),
+            "{\"ok\":%s,\"failed\":%s,\"writes\":%d,\"suppressed\":%d,\"skew_us\":%.1f,\"elapsed_us\":%llu",
+            st->failed < 0 ? "true" : "false", failed, issued, suppressed,
+            a && b ? (a > b ? a - b : b - a) / 1000.0 : 0.0, (unsigned long long)((now_ns() - st->t_submit) / 1000));
+        for (int f = 0; f < FLUSHES; f++)
+            n += snprintf(json + n, sizeof(json) - n, ",\"%s\":{\"bytes\":%zu,\"write_us\":%.1f,\"wire_us\":%llu}",
+                flush_names[f], st->flush[f].bytes, st->flush[f].write_ns / 1000.0,
+                baud > 0 ? (unsigned long long)st->flush[f].bytes * 10000000 / baud : 0ull);
+        snprintf(json + n, sizeof(json) - n, "}");
+        send_response(conn, st->failed < 0 ? "200 OK" : "502 Bad Gateway", "application/json", json);
+    }
+    stage_free(st);
+    conn_resume(conn);
+}
+
+// /stage - GET, PUT, DELETE
+// PUT takes one op ({"op":"servo","id":1,"pos":7000}) or several ({"ops":[...]}
+// or a bare array) of kinds servo, pio, pwm and dac; all are checked before
+// any is staged. Staging reaches no bus.
+static void handle_stage(conn_t *conn, const char *method, const char *body, bus_sched_t *s) {
+    stage_t **pp = stage_find(s, conn->client), *st = *pp;
+    if (strcmp(method, "DELETE") == 0) {
+        if (st) stage_free(stage_unlink(pp));
+        send_204(conn);
+        return;
+    }
+    if (strcmp(method, "GET") == 0) {
+        strbuf_t b = sb_scratch(conn);
+        int err = sb_printf(&b, "{\"staged\":[");
+        for (int i = 0; st && i < st->n; i++)
+            err |= sb_printf(&b, "%s{\"op\":\"%s\",\"target\":%d,\"v\":[%d,%d]}", i ? "," : "",
+                cmd_names[st->cmd[i]->kind], st->cmd[i]->target, st->cmd[i]->v[0], st->cmd[i]->v[1]);
+        err |= sb_printf(&b, "]}");
+        if (err) send_503(conn, err_nomem);
+        else send_response_buf(conn, "200 OK", "application/json", b.buf, b.len);
+        sb_rewind(&b);
+        return;
+    }
+    if (strcmp(method, "PUT") != 0) { send_405(conn); return; }
+    bus_cmd_t *in[STAGE_MAX_OPS];
+    int n = 0, at = 0;
+    const char *err = NULL, *o = json_field(body, "ops"), *p = o && *o == '[' ? o : NULL;
+    char msg[128];
+    while (*body == ' ' || *body == '\t' || *body == '\r' || *body == '\n') body++;
+    if (*body == '[') p = body;
+    if (p) {
+        char *obj = arena_alloc(&conn->arena, MAX_REQ_SIZE);
+        size_t olen = 0;
+        if (!obj) { send_503(conn, err_nomem); return; }
+        p++;
+        while (!err && (p = json_next_object(p, obj, MAX_REQ_SIZE, &olen))) {
+            if (n == STAGE_MAX_OPS) err = "Too many ops";
+            else if ((in[n] = cmd_parse_op(obj, &err))) err = stage_kind(in[n++]);
+            if (err && err != err_nomem) snprintf(msg, sizeof(msg), "op %d: %s", at, err), err = msg;
+            at++;
+        }
+        if (!err && olen == (size_t)-1) err = "Malformed ops";
+    } else if ((in[0] = cmd_parse_op(body, &err))) {
+        err = stage_kind(in[n++]);
+    }
+    if (!err && !n) err = "Missing ops";
+    if (!err && !st && stages.n == STAGE_MAX) err = "Too many staging areas";
+    if (!err && !st && !(st = calloc(1, sizeof(*st)))) err = err_nomem;
+    if (err) {
+        for (int i = 0; i < n; i++) bus_cmd_free(in[i]);
+        if (err == err_nomem) send_503(conn, err);
+        else send_400(conn, err);
+        return;
+    }
+    if (!*pp) {
+        st->board = s;
+        st->client = conn->client;
+        st->expiry = (wtimer_t){.fn = stage_expire, .arg = st};
+        st->next = stages.list;
+        stages.list = st;
+        stages.n++;
+    }
+    if (stages.ttl_ms > 0) twheel_add(&loop.wheel, &st->expiry, stages.ttl_ms);
+    else twheel_del(&loop.wheel, &st->expiry);
+    for (int i = 0; i < n; i++) {
+        int k = 0;
+        while (k < st->n && (st->cmd[k]->kind != in[i]->kind || st->cmd[k]->target != in[i]->target)) k++;
+        if (k == st->n) st->n++;
+        else bus_cmd_free(st->cmd[k]);
+        st->cmd[k] = in[i];
+    }
+    char json[32];
+    snprintf(json, sizeof(json), "{\"staged\":%d}", st->n);
+    send_json(conn, json);
+}
+
+// /commit - POST
+// Answers once the staged writes are out: 200, or 502 naming the bus that failed.
+static void handle_commit(conn_t *conn, bus_sched_t *s) {
+    stage_t **pp = stage_find(s, conn->client), *st = *pp;
+    if (!st) { send_400(conn, "Nothing staged"); return; }
+    bus_cmd_t *c = bus_cmd_new(CMD_COMMIT, 0, 0);
+    if (!c) { send_503(conn, err_nomem); return; }
+    stage_unlink(pp);
+    for (int i = 0; i < st->n; i++) {
+        st->cmd[i]->client = conn->client;
+        st->cmd[i]->client_ms = conn->client_ms;
+        st->cmd[i]->req = conn->req;
+    }
+    st->failed = -1;
+    st->owner = conn;
+    st->t_submit = now_ns();
+    st->done = (post_t){.fn = commit_done, .arg = st};
+    c->stage = st;
+    conn->state = CONN_BUSY;
+    conn_watch(conn, EPOLLRDHUP);
+    conn_timeout(conn, 0);
+    sched_submit(s, c);
+}
+
+// /boards - GET
+static const char *link_up(bus_sched_t *s, int kind) {
+    return atomic_load(&s->link[kind].state) == LINK_UP ? "true" : "false";
+}
+
+static void handle_boards(conn_t *conn) {
+    strbuf_t b = sb_scratch(conn);
+    int err = sb_printf(&b, "[");
+    for (int i = 0; i < nboards; i++) {
+        board_t *bd = &boards[i];
+        pthread_mutex_lock(&bd->sched.status.lock);
+        uint64_t version = bd->sched.status.version;
+        pthread_mutex_unlock(&bd->sched.status.lock);
+        err |= sb_printf(&b, "%s{\"id\":\"%s\",\"uart\":%s,\"i2c\":%s,\"spi\":%s,\"ics\":%s,\"version\":%llu}",
+            i ? "," : "", bd->id, link_up(&bd->sched, BUS_UART), link_up(&bd->sched, BUS_I2C),
+            link_up(&bd->sched, BUS_SPI), link_up(&bd->sched, BUS_ICS), (unsigned long long)version);
+    }
+    err |= sb_printf(&b, "]");
+    if (err) send_503(conn, err_nomem);
+    else send_response_buf(conn, "200 OK", "application/json", b.buf, b.len);
+    sb_rewind(&b);
+}
+
+// /healthz, /readyz - GET
+// Liveness only needs the event loop to answer; readiness also needs every
+// configured bus of every board attached to its worker.
+static void handle_health(conn_t *conn, int readiness) {
+    strbuf_t b = sb_scratch(conn);
+    int ready = 1, err = sb_printf(&b, "{\"boards\":[");
+    for (int i = 0; i < nboards; i++) {
+        err |= sb_printf(&b, "%s{\"id\":\"%s\"", i ? "," : "", boards[i].id);
+        for (int k = 0; k < BUS_KINDS; k++) {
+            bus_link_t *l = &boards[i].sched.link[k];
+            int st = atomic_load(&l->state), fails = atomic_load(&l->failures);
+            if (st == LINK_OPENING || st == LINK_DOWN) ready = 0;
+            err |= sb_printf(&b, ",\"%s\":{\"state\":\"%s\",\"failures\":%d,\"losses\":%d",
+                bus_names[k], link_state_names[st], fails, atomic_load(&l->losses));
+            if ((st == LINK_OPENING || st == LINK_DOWN) && atomic_load(&l->err)) err |= sb_printf(&b, ",\"error\":\"%s\"", strerror(atomic_load(&l->err)));
+            err |= sb_printf(&b, "}");
+        }
+        err |= sb_printf(&b, "}");
+    }
+    err |= sb_printf(&b, "],\"ready\":%s}", ready ? "true" : "false");
+    if (err) send_503(conn, err_nomem);
+    else send_response_buf(conn, readiness && !ready ? "503 Service Unavailable" : "200 OK", "application/json", b.buf, b.len);
+    sb_rewind(&b);
+}
+
+// /debug/sched - GET
+static int jitter_json(char *buf, size_t cap, jitter_t *j) {
+    uint64_t n = atomic_load(&j->n);
+    return snprintf(buf, cap, "{\"n\":%llu,\"avg_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}",
+        (unsigned long long)n, (unsigned long long)(n ? atomic_load(&j->sum_ns) / n / 1000 : 0),
+        (unsigned long long)jitter_quantile(j, 0.99), (unsigned long long)jitter_quantile(j, 0.999),
+        (unsigned long long)(atomic_load(&j->max_ns) / 1000));
+}
+
+static void handle_sched_stats(conn_t *conn, bus_sched_t *s) {
+    char json[896], tick[160], poll[160];
+    bus_cfg_t cfg = sched_cfg(s);
+    jitter_json(tick, sizeof(tick), &s->tick_jitter);
+    jitter_json(poll, sizeof(poll), &s->poll_jitter);
+    snprintf(json, sizeof(json),
+        "{\"submitted\":%llu,\"coalesced\":%llu,\"suppressed\":%llu,\"issued\":%llu,\"errors\":%llu,\"ticks\":%llu,"
+        "\"watchdog_trips\":%llu,\"poll_timeouts\":%llu,\"rt\":%s,\"tick_jitter\":%s,\"poll_jitter\":%s,"
+        "\"config\":{\"baud\":%d,\"spi_mode\":%d,\"spi_hz\":%d,\"tick_us\":%d,\"poll_ms\":%d},"
+        "\"journal\":{\"records\":%llu,\"dropped\":%llu}}",
+        (unsigned long long)s->submitted, (unsigned long long)s->coalesced,
+        (unsigned long long)s->suppressed, (unsigned long long)s->issued,
+        (unsigned long long)s->errors, (unsigned long long)s->ticks,
+        (unsigned long long)s->watchdog_trips, (unsigned long long)s->poll_timeouts, rt.enabled ? "true" : "false", tick, poll,
+        cfg.uart.baud, cfg.spi_mode, cfg.spi_speed, cfg.tick_us, cfg.poll_ms,
+        (unsigned long long)(s->jnl ? atomic_load(&s->jnl->records) : 0),
+        (unsigned long long)(s->jnl ? atomic_load(&s->jnl->dropped) : 0));
+    send_json(conn, json);
+}
+
+// /debug/trace - GET dumps Chrome trace-event JSON, PUT toggles tracing
+static void handle_trace_get(conn_t *conn) {
+    size_t len;
+    char *json = trace_dump(&len);
+    if (!json) { send_response(conn, "500 Internal Server Error", "application/json", "{\"error\":\"Out of memory\"}"); return; }
+    send_response_buf(conn, "200 OK", "application/json", json, len);
+    free(json);
+}
+static void handle_trace_put(conn_t *conn, const char *body) {
+    // Expects {"enabled":true}
+    int on;
+    if (!json_bool(body, "enabled", &on)) { send_400(conn, "Missing enabled"); return; }
+    atomic_store(&trace_on, on);
+    send_204(conn);
+}
+
+// PIO input edges
+// Inputs are local GPIO lines (PIO_GPIO=/dev/gpiochipN:off,off,...), whose
+// edges the kernel timestamps and queues on a line-request fd watched by the
+// event loop, and the board's DIP inputs, sampled by the status poller. Both
+// go through the same debounce: the first edge after a quiet period is
+// reported at once, bounces within PIO_DEBOUNCE_US are swallowed, and if the
+// line settled on the other level the edge is reported when the window ends.
+// Accepted edges are numbered and fanned out to GET /pio/events subscribers.
+#define PIO_DIP_INPUTS 4
+#define PIO_INPUTS_MAX (MAX_BOARDS * PIO_DIP_INPUTS + GPIO_V2_LINES_MAX)
+#define PIO_EVENT_RING 256
+
+typedef struct {
+    char name[48];
+    bus_sched_t *board;         // NULL for local GPIO lines
+    int level, raw;             // reported / last seen level
+    uint64_t last_ns;           // last reported edge (CLOCK_MONOTONIC)
+    uint64_t settle_ns;         // end of the debounce window to re-check, 0 if none
+    wtimer_t settle;            // fires at settle_ns
+} pio_input_t;
+
+typedef struct {
+    uint64_t seq, ns, wall_us;
+    int input, level;
+} pio_event_t;
+
+static struct {
+    pio_input_t in[PIO_INPUTS_MAX];
+    int n, gpio_fd, gpio_base;
+    uint32_t gpio_off[GPIO_V2_LINES_MAX];  // line offset of input gpio_base + i
+    uint64_t debounce_ns, seq;
+    pio_event_t ring[PIO_EVENT_RING];
+} pio_in = {.gpio_fd = -1};
+
+static int pio_event_json(char *buf, size_t cap, const pio_event_t *e) {
+    return snprintf(buf, cap, "id: %llu\nevent: edge\ndata: {\"seq\":%llu,\"input\":\"%s\",\"edge\":\"%s\",\"level\":%d,\"t_us\":%llu}\n\n",
+        (unsigned long long)e->seq, (unsigned long long)e->seq, pio_in.in[e->input].name,
+        e->level ? "rising" : "falling", e->level, (unsigned long long)e->wall_us);
+}
+
+static void pio_emit(int idx, int level, uint64_t ns) {
+    pio_input_t *in = &pio_in.in[idx];
+    in->level = level;
+    in->last_ns = ns;
+    in->settle_ns = 0;
+    twheel_del(&loop.wheel, &in->settle);
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint64_t now = now_ns(), age = now > ns ? now - ns : 0;
+    pio_event_t *e = &pio_in.ring[++pio_in.seq % PIO_EVENT_RING];
+    *e = (pio_event_t){.seq = pio_in.seq, .ns = ns, .input = idx, .level = level,
+        .wall_us = ((uint64_t)wall.tv_sec * 1000000000ull + wall.tv_nsec - age) / 1000};
+    char msg[256];
+    int n = pio_event_json(msg, sizeof(msg), e);
+    for (conn_t *c = loop.streams, *next; c; c = next) {
+        next = c->next;
+        if (c->board && c->board != in->board) continue;
+        if (sb_append(&c->out, msg, n) < 0) c->dead = 1;
+        conn_stream_flush(c);
+    }
+}
+
+static void pio_edge(int idx, int level, uint64_t ns) {
+    pio_input_t *in = &pio_in.in[idx];
+    in->raw = level;
+    if (level == in->level) { in->settle_ns = 0; twheel_del(&loop.wheel, &in->settle); return; }
+    if (ns - in->last_ns >= pio_in.debounce_ns) { pio_emit(idx, level, ns); return; }
+    in->settle_ns = in->last_ns + pio_in.debounce_ns;
+    uint64_t now = now_ns();
+    twheel_add(&loop.wheel, &in->settle, in->settle_ns > now ? (in->settle_ns - now + 999999) / 1000000 : 0);
+}
+
+// End of a debounce window: reports the level the line settled on.
+static void pio_settled(wtimer_t *t) {
+    pio_input_t *in = (pio_input_t *)((char *)t - offsetof(pio_input_t, settle));
+    if (in->raw != in->level) pio_emit(in - pio_in.in, in->raw, in->settle_ns);
+    else in->settle_ns = 0;
+}
+
+// Feeds the board's DIP inputs from the latest status sample.
+static void pio_board_inputs(bus_sched_t *s) {
+    pthread_mutex_lock(&s->status.lock);
+    int dip = s->status.cur.dip;
+    pthread_mutex_unlock(&s->status.lock);
+    uint64_t ns = now_ns();
+    for (int i = 0; i < PIO_DIP_INPUTS; i++) pio_edge(s->dip_input + i, dip >> i & 1, ns);
+}
+
+static void pio_gpio_read(void) {
+    struct gpio_v2_line_event ev[16];
+    ssize_t n = read(pio_in.gpio_fd, ev, sizeof(ev));
+    for (int i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+        for (int k = 0; k < pio_in.n - pio_in.gpio_base; k++)
+            if (pio_in.gpio_off[k] == ev[i].offset)
+                pio_edge(pio_in.gpio_base + k, ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE, ev[i].timestamp_ns);
+    }
+}
+
+// Requests "chip:off,off,..." as edge-reporting inputs; returns the line fd.
+static int pio_gpio_open(const char *spec) {
+    char chip[128];
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon - spec >= (int)sizeof(chip)) return -1;
+    snprintf(chip, sizeof(chip), "%.*s", (int)(colon - spec), spec);
+    struct gpio_v2_line_request req = {0};
+    for (const char *p = colon + 1; *p && req.num_lines < GPIO_V2_LINES_MAX; p += *p == ',') {
+        char *end;
+        req.offsets[req.num_lines++] = strtoul(p, &end, 10);
+        if (end == p) return -1;
+        p = end;
+    }
+    snprintf(req.consumer, sizeof(req.consumer), "kcb5-driver");
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    req.event_buffer_size = 256;
+    int cfd = open(chip, O_RDONLY | O_CLOEXEC);
+    if (cfd < 0) return -1;
+    int r = ioctl(cfd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(cfd);
+    if (r < 0) return -1;
+    struct gpio_v2_line_values vals = {.mask = req.num_lines >= 64 ? ~0ull : (1ull << req.num_lines) - 1};
+    ioctl(req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals);
+    fcntl(req.fd, F_SETFL, O_NONBLOCK);
+    pio_in.gpio_base = pio_in.n;
+    for (unsigned i = 0; i < req.num_lines; i++) {
+        pio_in.gpio_off[i] = req.offsets[i];
+        pio_input_t *in = &pio_in.in[pio_in.n++];
+        snprintf(in->name, sizeof(in->name), "gpio%u", req.offsets[i]);
+        in->level = in->raw = vals.bits >> i & 1;
+    }
+    return pio_in.gpio_fd = req.fd;
+}
+
+// DIP inputs are named dip0.. with one board, <board>.dip0.. with several.
+static void pio_inputs_init(const char *gpio, int debounce_us) {
+    pio_in.debounce_ns = (uint64_t)debounce_us * 1000;
+    for (int b = 0; b < nboards; b++) {
+        bus_sched_t *s = &boards[b].sched;
+        pthread_mutex_lock(&s->status.lock);
+        int dip = s->status.cur.dip;
+        pthread_mutex_unlock(&s->status.lock);
+        s->dip_input = pio_in.n;
+        for (int i = 0; i < PIO_DIP_INPUTS; i++) {
+            pio_input_t *in = &pio_in.in[pio_in.n++];
+            if (nboards > 1) snprintf(in->name, sizeof(in->name), "%s.dip%d", s->id, i);
+            else snprintf(in->name, sizeof(in->name), "dip%d", i);
+            in->board = s;
+            in->level = in->raw = dip >> i & 1;
+        }
+    }
+    if (gpio && pio_gpio_open(gpio) < 0) perror("PIO_GPIO");
+    for (int i = 0; i < pio_in.n; i++) pio_in.in[i].settle.fn = pio_settled;
+}
+
+// /pio/events - GET
+// Server-sent events: a "state" event with every input's level, then one
+// "edge" event per accepted edge. Last-Event-ID replays edges still in the ring.
+// Under /boards/{id}/ only that board's inputs are reported.
+static void handle_pio_events(conn_t *conn, const char *req, bus_sched_t *board) {
+    conn->board = board;
+    sb_printf(&conn->out,
+        "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n\r\nevent: state\ndata: {\"seq\":%llu,\"inputs\":{",
+        (unsigned long long)pio_in.seq);
+    for (int i = 0, comma = 0; i < pio_in.n; i++)
+        if (!board || pio_in.in[i].board == board)
+            sb_printf(&conn->out, "%s\"%s\":%d", comma++ ? "," : "", pio_in.in[i].name, pio_in.in[i].level);
+    sb_printf(&conn->out, "}}\n\n");
+    const char *h = strcasestr(req, "\r\nLast-Event-ID:");
+    if (h) {
+        uint64_t seq = strtoull(h + 16, NULL, 10);
+        if (pio_in.seq - seq > PIO_EVENT_RING) seq = pio_in.seq - PIO_EVENT_RING;
+        char msg[256];
+        while (seq < pio_in.seq) {
+            pio_event_t *e = &pio_in.ring[++seq % PIO_EVENT_RING];
+            if (board && pio_in.in[e->input].board != board) continue;
+            sb_append(&conn->out, msg, pio_event_json(msg, sizeof(msg), e));
+        }
+    }
+    conn->keepalive = 0;
+    conn_stream(conn);
+}
+
+// UDP command port
+// UDP_PORT takes binary setpoint datagrams, little endian:
+//   header  'K' 'U' u8 version(1) u8 type(1 = commands) u32 seq u8 nops u8 flags,
+//           2 pad; flags bit 0 (UDP_FLAG_RESET): the sender restarted its seq
+//   op      u8 op(1 servo, 2 pwm, 3 pio, 4 dac) u8 board(index) u8 target, pad,
+//           u16 v0 (pos / duty / value) u16 v1 (pwm period)
+// A setpoint only applies if seq is newer than the last one the same client
+// sent for that target; late or reordered ones are dropped, never queued.
+// A client starting over (a restarted teleop on the same address and port)
+// sets UDP_FLAG_RESET on its first datagram, so whatever seq it starts from
+// counts; a client slot handed to a new sender starts over the same way.
+// Every datagram is acked (type 2: seq, applied, stale, invalid), and clients
+// heard from in the last UDP_CLIENT_TTL_MS get a telemetry datagram (type 3)
+// whenever a board's status changes. Each sender is a watchdog client with a
+// timeout of UDP_WATCHDOG_MS: if it goes quiet, what it set goes safe.
+#define UDP_VERSION 1
+#define UDP_MAX_CLIENTS 16
+#define UDP_MAX_OPS 64
+#define UDP_CLIENT_TTL_MS 10000
+#define UDP_FLAG_RESET 0x01
+enum { UDP_CMD = 1, UDP_ACK, UDP_TELEMETRY };
+enum { UDP_OP_SERVO = 1, UDP_OP_PWM, UDP_OP_PIO, UDP_OP_DAC };
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t last_ns;           // 0: free slot
+    uint32_t id;                // watchdog client id
+} udp_client_t;
+
+typedef struct {
+    uint32_t seq;
+    int8_t client;              // -1: never set over UDP
+} udp_seq_t;
+
+static struct {
+    int fd, watchdog_ms;
+    udp_client_t client[UDP_MAX_CLIENTS];
+    udp_seq_t servo[MAX_BOARDS][ICS_IDS], pwm[MAX_BOARDS][PWM_CHANNELS];
+    udp_seq_t pio[MAX_BOARDS][PIO_PORTS], dac[MAX_BOARDS][DAC_CHANNELS];
+} udp = {.fd = -1};
+
+// Forgets the sequence numbers client slot ci set, so its next ones apply.
+static void udp_client_reset(int ci) {
+    udp_seq_t *gates[] = {&udp.servo[0][0], &udp.pwm[0][0], &udp.pio[0][0], &udp.dac[0][0]};
+    size_t n[] = {MAX_BOARDS * ICS_IDS, MAX_BOARDS * PWM_CHANNELS, MAX_BOARDS * PIO_PORTS, MAX_BOARDS * DAC_CHANNELS};
+    for (int k = 0; k < 4; k++)
+        for (size_t i = 0; i < n[k]; i++)
+            if (gates[k][i].client == ci) gates[k][i].client = -1;
+}
+
+static int udp_client_find(const struct sockaddr_storage *addr, socklen_t len, uint64_t now) {
+    int slot = -1;
+    for (int i = 0; i < UDP_MAX_CLIENTS; i++) {
+        udp_client_t *c = &udp.client[i];
+        if (c->last_ns && c->addr_len == len && memcmp(&c->addr, addr, len) == 0) return i;
+        // reuse a free slot, or one that went quiet
+        if (slot < 0 && (!c->last_ns || now - c->last_ns > UDP_CLIENT_TTL_MS * 1000000ull)) slot = i;
+    }
+    if (slot < 0) return -1;
+    udp_client_reset(slot);
+    memset(&udp.client[slot], 0, sizeof(udp.client[slot]));
+    memcpy(&udp.client[slot].addr, addr, len);
+    udp.client[slot].addr_len = len;
+    udp.client[slot].id = udp.watchdog_ms > 0 ? client_id(addr, len) : 0;
+    return slot;
+}
+
+// Latest-wins gate: takes seq if newer than what this client last set here.
+static int udp_seq_newer(udp_seq_t *t, int client, uint32_t seq) {
+    if (t->client == client && (int32_t)(seq - t->seq) <= 0) return 0;
+    t->client = client;
+    t->seq = seq;
+    return 1;
+}
+
+static void udp_read(void) {
+    uint8_t pkt[12 + UDP_MAX_OPS * 8];
+    struct sockaddr_storage addr;
+    for (;;) {
+        socklen_t alen = sizeof(addr);
+        ssize_t n = recvfrom(udp.fd, pkt, sizeof(pkt), 0, (struct sockaddr*)&addr, &alen);
+        if (n < 0) return;
+        if (n < 12 || pkt[0] != 'K' || pkt[1] != 'U' || pkt[2] != UDP_VERSION || pkt[3] != UDP_CMD) continue;
+        uint32_t seq = get_le32(pkt + 4);
+        int nops = pkt[8];
+        if (12 + nops * 8 > n) continue;
+        uint64_t now = now_ns();
+        int ci = udp_client_find(&addr, alen, now);
+        if (ci < 0) continue;
+        udp_client_t *c = &udp.client[ci];
+        c->last_ns = now;
+        if (pkt[9] & UDP_FLAG_RESET) udp_client_reset(ci);
+        int applied = 0, stale = 0, invalid = 0;
+        for (int i = 0; i < nops; i++) {
+            const uint8_t *op = pkt + 12 + i * 8;
+            int b = op[1], t = op[2], v0 = get_le16(op + 4), v1 = get_le16(op + 6);
+            udp_seq_t *gate = NULL;
+            bus_cmd_t *bc = NULL;
+            if (b >= nboards) { invalid++; continue; }
+            switch (op[0]) {
+            case UDP_OP_SERVO:
+                if (t < ICS_IDS && v0 <= 0x3fff) gate = &udp.servo[b][t];
+                break;
+            case UDP_OP_PWM:
+                if (t < PWM_CHANNELS && v0 <= 100 && v1 > 0) gate = &udp.pwm[b][t];
+                break;
+            case UDP_OP_PIO:
+                if (t < PIO_PORTS && v0 <= 0xff) gate = &udp.pio[b][t];
+                break;
+            case UDP_OP_DAC:
+                if (t < DAC_CHANNELS) gate = &udp.dac[b][t];
+                break;
+            }
+            if (!gate) { invalid++; continue; }
+            if (!udp_seq_newer(gate, ci, seq)) { stale++; continue; }
+            static const int kinds[] = {[UDP_OP_SERVO] = CMD_SERVO, [UDP_OP_PWM] = CMD_PWM,
+                                        [UDP_OP_PIO] = CMD_PIO, [UDP_OP_DAC] = CMD_DAC};
+            if (!(bc = bus_cmd_new(kinds[op[0]], t, 0))) { invalid++; continue; }
+            bc->v[0] = v0; bc->v[1] = v1;
+            bc->client = c->id;
+            bc->client_ms = udp.watchdog_ms;
+            sched_submit(&boards[b].sched, bc);
+            applied++;
+        }
+        uint8_t ack[12] = {'K', 'U', UDP_VERSION, UDP_ACK};
+        put_le32(ack + 4, seq);
+        ack[8] = applied; ack[9] = stale; ack[10] = invalid;
+        sendto(udp.fd, ack, sizeof(ack), MSG_DONTWAIT, (struct sockaddr*)&addr, alen);
+    }
+}
+
+static void udp_telemetry(int b) {
+    if (udp.fd < 0) return;
+    bus_sched_t *s = &boards[b].sched;
+    pthread_mutex_lock(&s->status.lock);
+    status_sample_t c = s->status.cur;
+    uint32_t version = s->status.version;
+    pthread_mutex_unlock(&s->status.lock);
+    uint8_t pkt[36] = {'K', 'U', UDP_VERSION, UDP_TELEMETRY};
+    put_le32(pkt + 4, version);
+    pkt[8] = b; pkt[9] = c.dip; pkt[10] = c.led;
+    for (int i = 0; i < 4; i++) put_le16(pkt + 12 + 2 * i, c.ad[i]);
+    put_le32(pkt + 20, c.timer[0]);
+    put_le32(pkt + 24, c.timer[1]);
+    put_le32(pkt + 28, c.ts_ms);
+    put_le32(pkt + 32, c.ts_ms >> 32);
+    uint64_t now = now_ns();
+    for (int i = 0; i < UDP_MAX_CLIENTS; i++) {
+        udp_client_t *cl = &udp.client[i];
+        if (cl->last_ns && now - cl->last_ns < UDP_CLIENT_TTL_MS * 1000000ull)
+            sendto(udp.fd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr*)&cl->addr, cl->addr_len);
+    }
+}
+
+static int udp_open(int port, int watchdog_ms) {
+    udp.watchdog_ms = watchdog_ms;
+    memset(udp.servo, -1, sizeof(udp.servo));
+    memset(udp.pwm, -1, sizeof(udp.pwm));
+    memset(udp.pio, -1, sizeof(udp.pio));
+    memset(udp.dac, -1, sizeof(udp.dac));
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY};
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(fd); return -1; }
+    return udp.fd = fd;
+}
+
+// Admission control
+// Connections are capped in total (MAX_CONNS) and per TCP peer address
+// (MAX_CONNS_PER_IP); one over a cap gets a canned 503 at accept and is closed.
+// Requests are classed by route: motion (anything that writes to a board),
+// status (reads, history, event streams) and admin (/debug, /rom). A class
+// may be rate limited with a token bucket, RATE_<CLASS>=<per second>[/<burst>],
+// and gets 429 beyond it. While a board's bus queue is deeper than
+// SHED_QUEUE_DEPTH or its last tick found a command that had waited longer
+// than SHED_LAG_MS, status requests for that board are shed with 503 before
+// any work is done, so motion keeps the bus and the loop.
+enum { ROUTE_MOTION, ROUTE_STATUS, ROUTE_ADMIN, ROUTE_CLASSES };
+static const char *route_names[ROUTE_CLASSES] = {"motion", "status", "admin"};
+#define SOURCE_BUCKETS 256
+#define RETRY_AFTER_S 1
+
+typedef struct source {
+    struct source *next;
+    uint32_t addr;
+    int conns;
+} source_t;
+
+typedef struct {
+    double rate, burst, tokens;     // rate 0: unlimited
+    uint64_t last_ns;
+} bucket_t;
+
+static struct {
+    int max_conns, max_per_ip, conns;
+    int shed_depth;
+    uint64_t shed_lag_ns;
+    source_t *src[SOURCE_BUCKETS];
+    bucket_t bucket[ROUTE_CLASSES];
+    uint64_t refused, limited[ROUTE_CLASSES], shed;
+} adm;
+
+static void admission_init(void) {
+    static const char *env[ROUTE_CLASSES] = {"RATE_MOTION", "RATE_STATUS", "RATE_ADMIN"};
+    adm.max_conns = getenv_int("MAX_CONNS", 256);
+    adm.max_per_ip = getenv_int("MAX_CONNS_PER_IP", 64);
+    adm.shed_depth = getenv_int("SHED_QUEUE_DEPTH", 256);
+    adm.shed_lag_ns = (uint64_t)getenv_int("SHED_LAG_MS", 50) * 1000000;
+    for (int i = 0; i < ROUTE_CLASSES; i++) {
+        const char *v = getenv(env[i]);
+        if (!v) continue;
+        char *end;
+        bucket_t *b = &adm.bucket[i];
+        b->rate = strtod(v, &end);
+        b->burst = *end == '/' ? strtod(end + 1, NULL) : b->rate;
+        if (b->burst < 1) b->burst = 1;
+        b->tokens = b->burst;
+        b->last_ns = now_ns();
+    }
+}
+
+// Takes a connection slot for peer (NULL: Unix socket); NULL *src when refused.
+static int admit_conn(const struct sockaddr_in *peer, source_t **src) {
+    *src = NULL;
+    if (adm.conns >= adm.max_conns) return 0;
+    if (peer) {
+        uint32_t a = peer->sin_addr.s_addr;
+        source_t **head = &adm.src[(a * 2654435761u) >> 24], *e = *head;
+        while (e && e->addr != a) e = e->next;
+        if (e && e->conns >= adm.max_per_ip) return 0;
+        if (!e) {
+            if (!(e = calloc(1, sizeof(*e)))) return 0;
+            e->addr = a;
+            e->next = *head;
+            *head = e;
+        }
+        e->conns++;
+        *src = e;
+    }
+    adm.conns++;
+    return 1;
+}
+
+static void release_conn(source_t *e) {
+    adm.conns--;
+    if (!e || --e->conns) return;
+    source_t **pp = &adm.src[(e->addr * 2654435761u) >> 24];
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    free(e);
+}
+
+static int route_class(const char *path) {
+    if (strncmp(path, "/debug/", 7) == 0 || strcmp(path, "/rom") == 0) return ROUTE_ADMIN;
+    if (strcmp(path, "/boards") == 0 || strncmp(path, "/status", 7) == 0 || strcmp(path, "/pio/events") == 0)
+        return ROUTE_STATUS;
+    return ROUTE_MOTION;
+}
+
+static int bucket_take(bucket_t *b) {
+    if (b->rate <= 0) return 1;
+    uint64_t now = now_ns();
+    b->tokens += (now - b->last_ns) * 1e-9 * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last_ns = now;
+    if (b->tokens < 1) return 0;
+    b->tokens -= 1;
+    return 1;
+}
+
+static int sched_overloaded(bus_sched_t *s) {
+    int depth = __atomic_load_n(&s->depth, __ATOMIC_RELAXED);
+    return depth > adm.shed_depth ||
+        (depth && atomic_load_explicit(&s->lag_ns, memory_order_relaxed) > adm.shed_lag_ns);
+}
+
+// Answers the request itself and returns 0 if it is not admitted.
+static int admit_request(conn_t *conn, int cls, bus_sched_t *s) {
+    if (cls == ROUTE_STATUS && sched_overloaded(s)) {
+        adm.shed++;
+        send_retry(conn, "503 Service Unavailable", RETRY_AFTER_S);
+        return 0;
+    }
+    if (!bucket_take(&adm.bucket[cls])) {
+        adm.limited[cls]++;
+        send_retry(conn, "429 Too Many Requests", RETRY_AFTER_S);
+        return 0;
+    }
+    return 1;
+}
+
+// /debug/admission - GET
+static void handle_admission(conn_t *conn) {
+    char json[256];
+    snprintf(json, sizeof(json),
+        "{\"conns\":%d,\"max_conns\":%d,\"refused\":%llu,\"shed\":%llu,\"limited\":{\"%s\":%llu,\"%s\":%llu,\"%s\":%llu}}",
+        adm.conns, adm.max_conns, (unsigned long long)adm.refused, (unsigned long long)adm.shed,
+        route_names[0], (unsigned long long)adm.limited[0], route_names[1], (unsigned long long)adm.limited[1],
+        route_names[2], (unsigned long long)adm.limited[2]);
+    send_json(conn, json);
+}
+
+// Main HTTP dispatch
+// req holds exactly one request (headers and body), NUL-terminated.
+static void http_dispatch(conn_t *conn, char *req) {
+    static uint32_t next_req;
+    char method[8], path[256];
+    trace_req = conn->req = ++next_req;
+    TRACE_BEGIN(t_parse, parse);
+    const char *body = parse_http_request(req, method, path);
+    char *query = strchr(path, '?');
+    if (query) *query++ = 0;
+    else query = "";
+    // HTTP/1.1 stays open unless the client says close; 1.0 only on request
+    const char *eol = strstr(req, "\r\n");
+    const char *conn_hdr = strcasestr(req, "\r\nConnection:");
+    int http10 = eol && eol - req >= 8 && strncmp(eol - 8, "HTTP/1.0", 8) == 0;
+    conn->keepalive = !http10;
+    if (conn_hdr) {
+        conn_hdr += 13;
+        while (*conn_hdr == ' ') conn_hdr++;
+        if (strncasecmp(conn_hdr, "close", 5) == 0) conn->keepalive = 0;
+        else if (strncasecmp(conn_hdr, "keep-alive", 10) == 0) conn->keepalive = 1;
+    }
+    // X-Client-Id enrols the client's writes in the dead-man watchdog
+    const char *cid = strcasestr(req, "\r\nX-Client-Id:"), *cms = strcasestr(req, "\r\nX-Watchdog-Ms:");
+    conn->client = 0;
+    conn->client_ms = cms ? atoi(cms + 16) : wd_cfg.client_ms;
+    if (cid && conn->client_ms > 0 && conn->client_ms <= WD_CLIENT_MAX_MS) {
+        cid += 14;
+        while (*cid == ' ') cid++;
+        size_t n = strcspn(cid, " \r\n");
+        if (n) conn->client = client_id(cid, n);
+    }
+    TRACE_END(t_parse, parse, TR_PARSE, 0);
+
+    TRACE_BEGIN(t_disp, dispatch);
+    // /boards/{id}/<endpoint> addresses one board, bare endpoints the first.
+    bus_sched_t *s = &boards[0].sched, *only = NULL;
+    if (strncmp(path, "/boards/", 8) == 0) {
+        char *id = path + 8, *rest = strchr(id, '/');
+        if (rest && (s = only = board_find(id, rest - id))) memmove(path, rest, strlen(rest) + 1);
+        else path[0] = 0;
+    }
+    // Orchestrator probes bypass rate limits and shedding.
+    int probe = strcmp(path, "/healthz") == 0 || strcmp(path, "/readyz") == 0;
+    if (!probe && !admit_request(conn, route_class(path), s)) {
+        TRACE_END(t_disp, dispatch, TR_DISPATCH, 0);
+        return;
+    }
+    if (strcmp(path, "/boards")==0 && strcmp(method,"GET")==0) {
+        handle_boards(conn);
+    } else if (probe && strcmp(method,"GET")==0) {
+        handle_health(conn, path[1] == 'r');
+    } else if (strcmp(path, "/status")==0 && strcmp(method,"GET")==0) {
+        handle_status(conn, query, s);
+    } else if (strcmp(path, "/status/history")==0 && strcmp(method,"GET")==0) {
+        handle_history(conn, query, s);
+    } else if (strcmp(path, "/status/history/export")==0 && strcmp(method,"GET")==0) {
+        handle_history_export(conn, query, req, s);
+    } else if (strcmp(path,"/rom")==0 && strcmp(method,"PUT")==0) {
+        handle_rom(conn, body);
+    } else if (strcmp(path,"/dac")==0 && strcmp(method,"PUT")==0) {
+        handle_dac(conn, body, s);
+    } else if (strcmp(path,"/bus")==0 && strcmp(method,"PUT")==0) {
+        handle_bus(conn, body, s);
+    } else if (strcmp(path,"/servo")==0 && strcmp(method,"PUT")==0) {
+        handle_servo(conn, body, s);
+    } else if (strcmp(path,"/uart")==0 && strcmp(method,"POST")==0) {
+        handle_uart(conn, body, s);
+    } else if (strcmp(path,"/pwm")==0 && strcmp(method,"PUT")==0) {
+        handle_pwm(conn, body, s);
+    } else if (strcmp(path,"/pio")==0 && strcmp(method,"PUT")==0) {
+        handle_pio(conn, body, s);
+    } else if (strcmp(path,"/pio/events")==0 && strcmp(method,"GET")==0) {
+        handle_pio_events(conn, req, only);
+    } else if (strcmp(path,"/debug/trace")==0 && strcmp(method,"GET")==0) {
+        handle_trace_get(conn);
+    } else if (strcmp(path,"/debug/trace")==0 && strcmp(method,"PUT")==0) {
+        handle_trace_put(conn, body);
+    } else if (strcmp(path,"/watchdog")==0 && strcmp(method,"PUT")==0) {
+        handle_watchdog(conn, only);
+    } else if (strcmp(path,"/batch")==0 && strcmp(method,"POST")==0) {
+        handle_batch(conn, body, s);
+    } else if (strncmp(path,"/sequences",10)==0 && (path[10]==0 || path[10]=='/')) {
+        handle_sequences(conn, method, path + 10, body, s);
+    } else if (strcmp(path,"/stage")==0) {
+        handle_stage(conn, method, body, s);
+    } else if (strcmp(path,"/commit")==0 && strcmp(method,"POST")==0) {
+        handle_commit(conn, s);
+    } else if (strcmp(path,"/debug/sched")==0 && strcmp(method,"GET")==0) {
+        handle_sched_stats(conn, s);
+    } else if (strcmp(path,"/debug/admission")==0 && strcmp(method,"GET")==0) {
+        handle_admission(conn);
+    } else if (strcmp(path,"/status")==0 || strcmp(path,"/status/history")==0 || strcmp(path,"/debug/trace")==0) {
+        send_405(conn);
+    } else {
+        send_404(conn);
+    }
+    TRACE_END(t_disp, dispatch, TR_DISPATCH, 0);
+}
+
+// Event loop
+// Level-triggered epoll over the listening socket, the wake eventfd and every
+// client. A connection is READING (EPOLLIN) until a full request is buffered,
+// WRITING (EPOLLOUT) while its reply does not fit the socket buffer, and
+// PARKED/BUSY (EPOLLRDHUP only, to notice the client leaving) while a
+// long-poll or batch holds the reply back.
+// Each connection has one timer, armed for what it is waiting on: the rest of
+// a request once its first byte is in (READ_TIMEOUT_MS, answered with 408),
+// the next request on an idle keep-alive connection (IDLE_TIMEOUT_MS), the
+// client draining a reply (WRITE_TIMEOUT_MS, re-armed on progress) or the
+// long-poll deadline. The wheel's earliest slot is mirrored into a timerfd,
+// re-armed only when that slot moves earlier, so a refresh costs no syscall.
+#define LOOP_MAX_EVENTS 64
+
+enum { FLUSH_DONE, FLUSH_PENDING, FLUSH_CLOSED };
+
+static void conn_watch(conn_t *conn, uint32_t events) {
+    if (conn->events == events) return;
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(loop.ep, EPOLL_CTL_MOD, conn->fd, &ev) < 0) perror("epoll_ctl");
+    conn->events = events;
+}
+
+static void conn_timeout(conn_t *conn, int ms) {
+    if (ms > 0) twheel_add(&loop.wheel, &conn->timer, ms);
+    else twheel_del(&loop.wheel, &conn->timer);
+}
+
+static void conn_close(conn_t *conn) {
+    twheel_del(&loop.wheel, &conn->timer);
+    if (conn->state == CONN_BUSY) {
+        // The worker still owns the reply; batch_done frees the connection.
+        epoll_ctl(loop.ep, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->dead = 1;
+        return;
+    }
+    if (conn->state == CONN_PARKED) conn_unlink(&loop.parked, conn);
+    if (conn->state == CONN_STREAM) conn_unlink(&loop.streams, conn);
+    if (conn->produce_free) conn->produce_free(conn);
+    release_conn(conn->src);
+    close(conn->fd);
+    sb_rewind(&conn->out);
+    slab_put(&loop.out_pool, conn->out.fixed);
+    slab_put(&loop.arena_pool, conn->arena.base);
+    slab_put(&loop.conn_pool, conn);
+}
+
+// Writes out as much buffered output as the socket takes, refilling it from
+// the producer of a streamed body.
+static int conn_flush(conn_t *conn) {
+    for (;;) {
+        if (conn->out_off < conn->out.len) {
+            TRACE_BEGIN(t_send, send);
+            ssize_t w = send(conn->fd, conn->out.buf + conn->out_off, conn->out.len - conn->out_off, MSG_NOSIGNAL);
+            TRACE_END(t_send, send, TR_SEND, w > 0 ? w : 0);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN ? FLUSH_PENDING : FLUSH_CLOSED;
+            }
+            conn->out_off += w;
+            continue;
+        }
+        sb_rewind(&conn->out);
+        conn->out_off = 0;
+        if (conn->dead) return FLUSH_CLOSED;
+        if (!conn->produce) return FLUSH_DONE;
+        if (!conn->produce(conn)) {
+            conn->produce_free(conn);
+            conn->produce = NULL;
+            conn->produce_free = NULL;
+        }
+    }
+}
+
+// Flushes and picks the next state; returns 0 once the connection is gone.
+static int conn_output(conn_t *conn) {
+    int r = conn_flush(conn);
+    if (r == FLUSH_CLOSED || (r == FLUSH_DONE && !conn->keepalive)) { conn_close(conn); return 0; }
+    conn->state = r == FLUSH_PENDING ? CONN_WRITING : CONN_READING;
+    conn_watch(conn, r == FLUSH_PENDING ? EPOLLOUT : EPOLLIN | EPOLLRDHUP);
+    // a partly read request keeps the read timer it got with its first byte
+    if (r == FLUSH_PENDING) conn_timeout(conn, loop.write_ms);
+    else if (!conn->in_len) conn_timeout(conn, loop.idle_ms);
+    return 1;
+}
+
+// A subscriber that stops reading is dropped rather than buffered without bound.
+#define STREAM_MAX_BACKLOG (256 * 1024)
+
+static void conn_stream_flush(conn_t *conn) {
+    int r = conn_flush(conn);
+    if (r == FLUSH_CLOSED || conn->out.len - conn->out_off > STREAM_MAX_BACKLOG) { conn_close(conn); return; }
+    conn_watch(conn, r == FLUSH_PENDING ? EPOLLOUT | EPOLLRDHUP : EPOLLRDHUP);
+}
+
+// Body length from the headers, 0 without one; -1 unless the value is a plain
+// decimal number (strtoul would take "-1" or " +5").
+static int content_length(const char *req, size_t *len) {
+    const char *h = strcasestr(req, "\r\nContent-Length:");
+    *len = 0;
+    if (!h) return 0;
+    for (h += 17; *h == ' ' || *h == '\t'; h++) {}
+    if (*h < '0' || *h > '9') return -1;
+    char *e;
+    errno = 0;
+    unsigned long long v = strtoull(h, &e, 10);
+    while (*e == ' ' || *e == '\t') e++;
+    if (errno == ERANGE || v > SIZE_MAX || *e != '\r') return -1;
+    *len = v;
+    return 0;
+}
+
+// Answers every complete request in the input buffer (pipelining), stopping at
+// one that parks the connection or streams its reply.
+static void conn_process(conn_t *conn) {
+    int served = 0;
+    while (conn->state == CONN_READING && conn->keepalive && !conn->produce) {
+        char *end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+        if (!end) {
+            if (conn->in_len == MAX_REQ_SIZE) send_413(conn);
+            break;
+        }
+        // The previous reply is in conn->out by now; its scratch can go.
+        conn->arena.used = 0;
+        char *req = arena_alloc(&conn->arena, MAX_REQ_SIZE + 1);
+        size_t hlen = end + 4 - conn->in;
+        memcpy(req, conn->in, hlen);
+        req[hlen] = 0;
+        size_t blen;
+        if (content_length(req, &blen) < 0) { conn->keepalive = 0; send_400(conn, "Invalid Content-Length"); break; }
+        if (blen > MAX_REQ_SIZE - hlen) { send_413(conn); break; }
+        size_t total = hlen + blen;
+        if (conn->in_len < total) break;
+        memcpy(req + hlen, conn->in + hlen, total - hlen);
+        req[total] = 0;
+        conn->in_len -= total;
+        memmove(conn->in, conn->in + total, conn->in_len);
+        http_dispatch(conn, req);
+        served = 1;
+    }
+    if (served && conn->in_len) conn_timeout(conn, loop.read_ms);   // next request already started
+    if (conn->state == CONN_READING) conn_output(conn);
+}
+
+static void conn_read(conn_t *conn) {
+    TRACE_BEGIN(t_recv, recv);
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, MAX_REQ_SIZE - conn->in_len, 0);
+    TRACE_END(t_recv, recv, TR_RECV, n > 0 ? n : 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) { conn_close(conn); return; }
+    if (!conn->in_len) conn_timeout(conn, loop.read_ms);
+    conn->in_len += n;
+    conn_process(conn);
+}
+
+// Picks up where a parked or busy connection left off once its reply is queued.
+static void conn_resume(conn_t *conn) {
+    if (conn->dead) { conn->state = CONN_READING; conn_close(conn); return; }
+    conn->state = CONN_READING;
+    conn_process(conn);
+}
+
+static void conn_park(conn_t *conn, int timeout_ms) {
+    conn->state = CONN_PARKED;
+    conn_link(&loop.parked, conn);
+    conn_watch(conn, EPOLLRDHUP);
+    conn_timeout(conn, timeout_ms);
+}
+
+// Turns the connection into an open-ended stream; conn_stream_flush sends what
+// was appended since.
+static void conn_stream(conn_t *conn) {
+    conn->state = CONN_STREAM;
+    conn_link(&loop.streams, conn);
+    conn_timeout(conn, 0);
+    conn_stream_flush(conn);
+}
+
+// Answers parked long-polls whose board moved on.
+static void parked_wake(void) {
+    for (conn_t *c = loop.parked, *n; c; c = n) {
+        n = c->next;
+        bus_sched_t *s = c->board;
+        pthread_mutex_lock(&s->status.lock);
+        int changed = s->status.version != c->since;
+        pthread_mutex_unlock(&s->status.lock);
+        if (!changed) continue;
+        conn_unlink(&loop.parked, c);
+        trace_req = c->req;
+        status_reply(c, s);
+        conn_resume(c);
+    }
+}
+
+static void conn_expired(wtimer_t *t) {
+    conn_t *conn = (conn_t *)((char *)t - offsetof(conn_t, timer));
+    trace_req = conn->req;
+    switch (conn->state) {
+    case CONN_READING:
+        if (!conn->in_len) break;
+        conn->in_len = 0;
+        conn->keepalive = 0;
+        send_response(conn, "408 Request Timeout", "application/json", "{\"error\":\"Request timeout\"}");
+        conn_output(conn);
+        return;
+    case CONN_PARKED:
+        conn_unlink(&loop.parked, conn);
+        status_reply(conn, conn->board);
+        conn_resume(conn);
+        return;
+    }
+    conn_close(conn);
+}
+
+// Points the timerfd at the wheel's earliest slot when that moved earlier; a
+// wake-up for a timer cancelled since just finds nothing to run.
+static void loop_timer_arm(void) {
+    if (loop.wheel.soonest >= loop.timer_at) return;
+    uint64_t ns = loop.wheel.soonest * 1000000;
+    struct itimerspec its = {.it_value = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000}};
+    if (timerfd_settime(loop.timer, TFD_TIMER_ABSTIME, &its, NULL) < 0) { perror("timerfd"); return; }
+    loop.timer_at = loop.wheel.soonest;
+}
+
+// Unix socket listener
+// UNIX_SOCKET=/path (or @name for the abstract namespace) serves the same HTTP
+// API to local clients. Peers are checked with SO_PEERCRED against
+// UNIX_ALLOW_UIDS (comma list); without it a path socket is guarded by its
+// UNIX_SOCKET_MODE (default 0660) and an abstract one, which has no
+// permissions, admits only root and the driver's own user.
+#define UNIX_MAX_UIDS 16
+
+static struct {
+    uid_t uid[UNIX_MAX_UIDS];
+    int n, abstract;
+} unix_acl;
+
+static int unix_listen_open(const char *path) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    size_t len = strlen(path);
+    unix_acl.abstract = path[0] == '@';
+    if (len >= sizeof(sun.sun_path)) { errno = ENAMETOOLONG; return -1; }
+    memcpy(sun.sun_path, path, len);
+    if (unix_acl.abstract) sun.sun_path[0] = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    // A socket left behind by a previous run would make bind fail.
+    if (!unix_acl.abstract && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if (bind(fd, (struct sockaddr*)&sun, offsetof(struct sockaddr_un, sun_path) + len) < 0 ||
+        (!unix_acl.abstract && chmod(path, strtol(getenv_default("UNIX_SOCKET_MODE", "0660"), NULL, 8)) < 0) ||
+        listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    for (const char *p = getenv("UNIX_ALLOW_UIDS"); p && *p && unix_acl.n < UNIX_MAX_UIDS; p += *p == ',') {
+        char *end;
+        unix_acl.uid[unix_acl.n++] = strtoul(p, &end, 10);
+        if (end == p) break;
+        p = end;
+    }
+    return fd;
+}
+
+static int unix_peer_allowed(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+    if (unix_acl.n) {
+        for (int i = 0; i < unix_acl.n; i++)
+            if (unix_acl.uid[i] == cred.uid) return 1;
+    } else if (!unix_acl.abstract || cred.uid == 0 || cred.uid == getuid()) {
+        return 1;
+    }
+    fprintf(stderr, "unix: rejected pid %d uid %d\n", (int)cred.pid, (int)cred.uid);
+    return 0;
+}
+
+static void loop_accept(int lfd) {
+    for (;;) {
+        TRACE_BEGIN(t_acc, accept);
+        struct sockaddr_in peer;
+        socklen_t plen = sizeof(peer);
+        int cfd = accept4(lfd, (struct sockaddr*)&peer, &plen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        TRACE_END(t_acc, accept, TR_ACCEPT, 0);
+        if (cfd < 0) {
+            if (errno != EAGAIN && errno != EINTR) perror("accept");
+            return;
+        }
+        int one = 1;
+        if (lfd == loop.unix_listen) {
+            if (!unix_peer_allowed(cfd)) { close(cfd); continue; }
+        } else {
+            setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        source_t *src;
+        if (!admit_conn(lfd == loop.unix_listen ? NULL : &peer, &src)) {
+            static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                "Retry-After: 1\r\nConnection: close\r\n\r\n";
+            adm.refused++;
+            send(cfd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        // Admitted connections never outnumber the pools.
+        conn_t *conn = slab_get(&loop.conn_pool);
+        memset(conn, 0, sizeof(*conn));
+        conn->out.buf = conn->out.fixed = slab_get(&loop.out_pool);
+        conn->out.cap = conn->out.fixed_cap = loop.out_pool.size;
+        conn->arena = (arena_t){.base = slab_get(&loop.arena_pool), .cap = loop.arena_pool.size};
+        conn->fd = cfd;
+        conn->src = src;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+        if (epoll_ctl(loop.ep, EPOLL_CTL_ADD, cfd, &ev) < 0) { conn_close(conn); continue; }
+        conn->keepalive = 1;
+        conn->events = ev.events;
+        conn->timer.fn = conn_expired;
+        conn_timeout(conn, loop.idle_ms);
+    }
+}
+
+// Configuration reload
+// SIGHUP, or CONFIG_FILE being rewritten or replaced (inotify on its
+// directory, as editors rename a new copy over it), re-reads the file and
+// applies what can change in place: rate limits, connection caps (up to the
+// pool size set at startup), shedding, timeouts, watchdogs, debounce and the
+// bus settings. Each board's baud rate, SPI mode/speed and tick reach its
+// worker as a CMD_CONFIG, so they switch between two transactions without
+// closing the devices. Listeners, boards, pools, SHM, RT and history need a
+// restart.
+static struct {
+    const char *path, *name;    // CONFIG_FILE and its basename
+    int sig, ino;               // signalfd (SIGHUP), inotify on the directory
+    int max_conns;              // pool size fixed at startup
+} reload = {.sig = -1, .ino = -1};
+
+static void loop_config(void) {
+    loop.read_ms = getenv_int("READ_TIMEOUT_MS", 10000);
+    loop.idle_ms = getenv_int("IDLE_TIMEOUT_MS", 60000);
+    loop.write_ms = getenv_int("WRITE_TIMEOUT_MS", 30000);
+    stages.ttl_ms = getenv_int("STAGE_TTL_MS", 30000);
+}
+
+static void config_reload(void) {
+    if (reload.path && config_load(reload.path) < 0) { perror(reload.path); return; }
+    admission_init();
+    if (adm.max_conns > reload.max_conns) adm.max_conns = reload.max_conns;
+    loop_config();
+    watchdog_init();
+    link_init();
+    udp.watchdog_ms = getenv_int("UDP_WATCHDOG_MS", 250);
+    pio_in.debounce_ns = (uint64_t)getenv_int("PIO_DEBOUNCE_US", 2000) * 1000;
+    for (int i = 0; i < nboards; i++) {
+        bus_sched_t *s = &boards[i].sched;
+        bus_cfg_t cfg;
+        board_cfg(boards[i].env, &cfg);
+        sched_set_poll(s, cfg.poll_ms);
+        bus_cmd_t *c = bus_cmd_new(CMD_CONFIG, 0, sizeof(cfg));
+        if (!c) continue;
+        memcpy(c->data, &cfg, sizeof(cfg));
+        sched_submit(s, c);
+    }
+    fprintf(stderr, "config: reloaded\n");
+}
+
+static void reload_read(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int hit = fd == reload.sig;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        for (char *p = buf; fd == reload.ino && p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, reload.name) == 0) hit = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    if (hit) config_reload();
+}
+
+static void reload_open(const char *path) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    reload.sig = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    reload.max_conns = adm.max_conns;
+    if (!path) return;
+    reload.path = path;
+    char dir[PATH_MAX];
+    reload.name = path_split(path, dir, sizeof(dir));
+    reload.ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reload.ino >= 0 && inotify_add_watch(reload.ino, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(dir);
+        close(reload.ino);
+        reload.ino = -1;
+    }
+}
+
+static void loop_run(void) {
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(loop.ep, evs, LOOP_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) { perror("epoll_wait"); exit(1); }
+        int woken = 0, timed = 0;
+        for (int i = 0; i < n; i++) {
+            void *p = evs[i].data.ptr;
+            if (p == &loop.listen) { loop_accept(loop.listen); continue; }
+            if (p == &loop.unix_listen) { loop_accept(loop.unix_listen); continue; }
+            if (p == &loop.wake) { woken = 1; continue; }
+            if (p == &loop.timer) { timed = 1; continue; }
+            if (p == &pio_in.gpio_fd) { pio_gpio_read(); continue; }
+            if (p == &udp.fd) { udp_read(); continue; }
+            if (p == &reload.sig || p == &reload.ino) { reload_read(*(int *)p); continue; }
+            conn_t *conn = p;
+            uint32_t e = evs[i].events;
+            if (conn->state == CONN_STREAM && !(e & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) conn_stream_flush(conn);
+            else if (conn->state == CONN_PARKED || conn->state == CONN_BUSY || conn->state == CONN_STREAM ||
+                (e & (EPOLLERR | EPOLLHUP))) conn_close(conn);
+            else if (conn->state == CONN_WRITING) { if (conn_output(conn) && conn->in_len) conn_process(conn); }
+            else conn_read(conn);
+        }
+        if (timed) {
+            uint64_t cnt;
+            if (read(loop.timer, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) perror("timerfd");
+            loop.timer_at = UINT64_MAX;
+            twheel_run(&loop.wheel);
+        }
+        int changed = 0;
+        if (woken) {
+            uint64_t cnt;
+            if (read(loop.wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) perror("eventfd");
+            pthread_mutex_lock(&loop.lock);
+            post_t *posts = loop.posts;
+            loop.posts = NULL;
+            pthread_mutex_unlock(&loop.lock);
+            while (posts) {
+                post_t *next = posts->next;
+                posts->fn(posts->arg);
+                posts = next;
+            }
+            for (int b = 0; b < nboards; b++)
+                if (atomic_exchange(&boards[b].sched.status_changed, 0)) {
+                    changed = 1;
+                    pio_board_inputs(&boards[b].sched);
+                    udp_telemetry(b);
+                }
+        }
+        if (changed) parked_wake();
+        loop_timer_arm();
+    }
+}
+
+int main() {
+    // --- Configuration from environment ---
+    // SIGHUP is taken through a signalfd, so block it before any thread starts.
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    const char *config = getenv("CONFIG_FILE");
+    if (config && config_load(config) < 0) { perror(config); exit(1); }
+    const char *host = getenv_default("SERVER_HOST", "0.0.0.0");
+    int port = getenv_int("SERVER_PORT", 8080);
+    atomic_store(&trace_on, getenv_int("TRACE", 0) != 0);
+    rt_init();
+    watchdog_init();
+    link_init();
+    admission_init();
+
+    // The bus workers post completions to the event loop from the start.
+    loop.ep = epoll_create1(EPOLL_CLOEXEC);
+    loop.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop.ep < 0 || loop.wake < 0 || loop.timer < 0) { perror("epoll"); exit(1); }
+    twheel_init(&loop.wheel);
+    loop_config();
+    int arena_kb = getenv_int("REQ_ARENA_KB", 24);
+    if (arena_kb < 2 * MAX_REQ_SIZE / 1024 + 1) arena_kb = 2 * MAX_REQ_SIZE / 1024 + 1;
+    if (slab_init(&loop.conn_pool, sizeof(conn_t), adm.max_conns) < 0 ||
+        slab_init(&loop.out_pool, (size_t)getenv_int("SEND_BUF_KB", 16) * 1024, adm.max_conns) < 0 ||
+        slab_init(&loop.arena_pool, (size_t)arena_kb * 1024, adm.max_conns) < 0) { perror("pools"); exit(1); }
+    if (boards_open() != 0) { perror("boards"); exit(1); }
+    if (getenv("REPLAY")) return replay_run(getenv("REPLAY"));
+    seq_load();
+    rt_net_setup();
+
+    // --- Setup HTTP server ---
+    // SERVER_PORT=0 leaves only the Unix socket listening.
+    const char *unix_path = getenv("UNIX_SOCKET");
+    int sfd = -1;
+    if (port > 0 || !unix_path) {
+        sfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sfd < 0) { perror("socket"); exit(1); }
+        int optval = 1;
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind"); exit(1);
+        }
+        listen(sfd, SOMAXCONN);
+        fcntl(sfd, F_SETFL, O_NONBLOCK);
+    }
+    int udp_port = getenv_int("UDP_PORT", 0);
+    if (udp_port > 0) {
+        if (udp_open(udp_port, getenv_int("UDP_WATCHDOG_MS", 250)) < 0) { perror("UDP_PORT"); exit(1); }
+        struct epoll_event dev = {.events = EPOLLIN, .data.ptr = &udp.fd};
+        epoll_ctl(loop.ep, EPOLL_CTL_ADD, udp.fd, &dev);
+    }
+    if (unix_path && (loop.unix_listen = unix_listen_open(unix_path)) < 0) { perror(unix_path); exit(1); }
+    signal(SIGPIPE, SIG_IGN);
+
+    loop.listen = sfd;
+    pio_inputs_init(getenv("PIO_GPIO"), getenv_int("PIO_DEBOUNCE_US", 2000));
+    if (pio_in.gpio_fd >= 0) {
+        struct epoll_event gev = {.events = EPOLLIN, .data.ptr = &pio_in.gpio_fd};
+        epoll_ctl(loop.ep, EPOLL_CTL_ADD, pio_in.gpio_fd, &gev);
+    }
+    struct epoll_event lev = {.events = EPOLLIN, .data.ptr = &loop.listen};
+    struct epoll_event uev = {.events = EPOLLIN, .data.ptr = &loop.unix_listen};
+    struct epoll_event wev = {.events = EPOLLIN, .data.ptr = &loop.wake};
+    struct epoll_event tev = {.events = EPOLLIN, .data.ptr = &loop.timer};
+    if (sfd >= 0) epoll_ctl(loop.ep, EPOLL_CTL_ADD, sfd, &lev);
+    if (loop.unix_listen >= 0) epoll_ctl(loop.ep, EPOLL_CTL_ADD, loop.unix_listen, &uev);
+    epoll_ctl(loop.ep, EPOLL_CTL_ADD, loop.wake, &wev);
+    epoll_ctl(loop.ep, EPOLL_CTL_ADD, loop.timer, &tev);
+    reload_open(config);
+    struct epoll_event hev = {.events = EPOLLIN, .data.ptr = &reload.sig};
+    struct epoll_event iev = {.events = EPOLLIN, .data.ptr = &reload.ino};
+    if (reload.sig >= 0) epoll_ctl(loop.ep, EPOLL_CTL_ADD, reload.sig, &hev);
+    if (reload.ino >= 0) epoll_ctl(loop.ep, EPOLL_CTL_ADD, reload.ino, &iev);
+
+    if (sfd >= 0) printf("KCB-5 HTTP driver listening on %s:%d, %d board%s\n", host, port, nboards, nboards > 1 ? "s" : "");
+    if (unix_path) printf("KCB-5 HTTP driver listening on unix:%s\n", unix_path);
+    fflush(stdout);
+    loop_run();
+
+    if (sfd >= 0) close(sfd);
+    for (int i = 0; i < nboards; i++) {
+        board_t *b = &boards[i];
+        if (b->uart.fd>0) close(b->uart.fd);
+        if (b->i2c.fd>0 && !b->i2c.emu) close(b->i2c.fd);
+        if (b->spi.fd>0 && !b->spi.emu) close(b->spi.fd);
+        if (b->ics.fd>0) close(b->ics.fd);
+    }
     return 0;
 }
\ No newline at end of file
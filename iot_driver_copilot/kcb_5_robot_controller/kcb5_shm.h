@@ -0,0 +1,106 @@
+/*
+ * KCB-5 driver shared-memory channel, for clients on the same host.
+ *
+ * With SHM_NAME set (e.g. "/kcb5") the driver creates one POSIX shared memory
+ * region per board ("<SHM_NAME>-<board id>" when it drives several) holding:
+ *  - the latest status snapshot, published under a seqlock: readers retry
+ *    while the sequence is odd or changed during the copy;
+ *  - a single-producer/single-consumer command ring. The client writes a
+ *    slot and then publishes it by advancing head; the driver consumes from
+ *    tail. The driver sleeps on a futex on head once the ring is empty and
+ *    sets `waiting`, so a client only makes a syscall (FUTEX_WAKE) when the
+ *    driver is actually asleep.
+ * Only one thread of one process may produce commands per region.
+ *
+ * Client use:
+ *   kcb5_shm_t *m = kcb5_shm_open("/kcb5");
+ *   kcb5_status_t st; kcb5_shm_status(m, &st);
+ *   kcb5_shm_send(m, KCB5_SHM_SERVO, 3, 7500, 0);
+ */
+#ifndef KCB5_SHM_H
+#define KCB5_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define KCB5_SHM_MAGIC 0x31304d533542434bull    // "KCB5SM01"
+#define KCB5_SHM_VERSION 1
+#define KCB5_SHM_RING 1024                      // power of two
+
+// Command kinds; targets and values are validated like the HTTP endpoints.
+enum {
+    KCB5_SHM_SERVO = 1,     // target: ICS id, v0: position
+    KCB5_SHM_PWM,           // target: channel, v0: duty %, v1: period
+    KCB5_SHM_DAC,           // target: channel, v0: value
+    KCB5_SHM_PIO,           // target: port, v0: value
+};
+
+typedef struct {
+    uint32_t kind, target;
+    int32_t v[2];
+} kcb5_cmd_t;
+
+typedef struct {
+    uint64_t version;       // bumps when the board state changes
+    uint64_t ts_ms;         // wall clock of the sample
+    uint16_t ad[4];
+    uint8_t dip, led;
+    uint16_t reserved;
+    uint32_t timer[2];
+} kcb5_status_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version, ring_size;
+    _Alignas(64) _Atomic uint32_t status_seq;
+    kcb5_status_t status;
+    _Alignas(64) _Atomic uint32_t head;         // client: next slot to fill
+    _Alignas(64) _Atomic uint32_t tail;         // driver: next slot to take
+    _Atomic uint32_t waiting;                   // driver asleep on head
+    _Atomic uint32_t rejected;                  // commands that failed validation
+    _Alignas(64) kcb5_cmd_t ring[KCB5_SHM_RING];
+} kcb5_shm_t;
+
+static inline kcb5_shm_t *kcb5_shm_open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+    void *p = mmap(NULL, sizeof(kcb5_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    kcb5_shm_t *m = p;
+    if (m->magic != KCB5_SHM_MAGIC || m->version != KCB5_SHM_VERSION) {
+        munmap(p, sizeof(kcb5_shm_t));
+        return NULL;
+    }
+    return m;
+}
+
+// Copies a consistent status snapshot.
+static inline void kcb5_shm_status(kcb5_shm_t *m, kcb5_status_t *out) {
+    uint32_t s0, s1;
+    do {
+        s0 = atomic_load_explicit(&m->status_seq, memory_order_acquire);
+        memcpy(out, (const void *)&m->status, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(&m->status_seq, memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+}
+
+// Queues one command; returns -1 when the ring is full.
+static inline int kcb5_shm_send(kcb5_shm_t *m, uint32_t kind, uint32_t target, int32_t v0, int32_t v1) {
+    uint32_t head = atomic_load_explicit(&m->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&m->tail, memory_order_acquire) >= KCB5_SHM_RING) return -1;
+    m->ring[head & (KCB5_SHM_RING - 1)] = (kcb5_cmd_t){kind, target, {v0, v1}};
+    atomic_store_explicit(&m->head, head + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&m->waiting, memory_order_seq_cst))
+        syscall(SYS_futex, &m->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return 0;
+}
+
+#endif